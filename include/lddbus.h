@@ -28,6 +28,7 @@ struct ldd_driver {
 struct ldd_device {
 	char *name;
 	struct ldd_driver *driver;
+	int node;		/* NUMA node for its memory, -1 for none */
 	struct device dev;
 };
 
@@ -37,3 +38,4 @@ extern int register_ldd_device(struct ldd_device *);
 extern void unregister_ldd_device(struct ldd_device *);
 extern int register_ldd_driver(struct ldd_driver *);
 extern void unregister_ldd_driver(struct ldd_driver *);
+extern int ldd_node_has_memory(int nid);
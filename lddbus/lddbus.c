@@ -21,6 +21,7 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/string.h>
+#include <linux/mmzone.h>
 #include "lddbus.h"
 
 MODULE_AUTHOR("Jonathan Corbet");
@@ -89,6 +90,48 @@ static BUS_ATTR(version, S_IRUGO, show_bus_version, NULL);
  * LDD devices.
  */
 
+/*
+ * Whether a NUMA node is there and has memory to give. The online node
+ * map isn't exported to modules, but the per-node data is, and it's
+ * only filled in for nodes that are.
+ */
+int ldd_node_has_memory(int nid)
+{
+#ifdef CONFIG_DISCONTIGMEM
+	return nid >= 0 && nid < MAX_NUMNODES && NODE_DATA(nid) &&
+		node_present_pages(nid) > 0;
+#else
+	return nid == 0;
+#endif
+}
+EXPORT_SYMBOL(ldd_node_has_memory);
+
+/*
+ * The node attribute: where the device would like its memory to be.
+ * The driver sets the initial value before registering; -1 means
+ * "wherever the allocating process happens to run".
+ */
+static ssize_t show_node(struct device *dev, char *buf)
+{
+	struct ldd_device *ldddev = to_ldd_device(dev);
+
+	return sprintf(buf, "%i\n", ldddev->node);
+}
+
+static ssize_t store_node(struct device *dev, const char *buf, size_t count)
+{
+	struct ldd_device *ldddev = to_ldd_device(dev);
+	char *end;
+	long nid = simple_strtol(buf, &end, 0);
+
+	if (end == buf || (nid != -1 && !ldd_node_has_memory(nid)))
+		return -EINVAL;
+	ldddev->node = nid;
+	return count;
+}
+
+static DEVICE_ATTR(node, S_IRUGO | S_IWUSR, show_node, store_node);
+
 /*
  * For now, no references to LDDbus devices go out which are not
  * tracked via the module reference count, so we use a no-op
@@ -99,16 +142,24 @@ static void ldd_dev_release(struct device *dev)
 
 int register_ldd_device(struct ldd_device *ldddev)
 {
+	int ret;
+
 	ldddev->dev.bus = &ldd_bus_type;
 	ldddev->dev.parent = &ldd_bus;
 	ldddev->dev.release = ldd_dev_release;
 	strncpy(ldddev->dev.bus_id, ldddev->name, BUS_ID_SIZE);
-	return device_register(&ldddev->dev);
+	if (ldddev->node != -1 && !ldd_node_has_memory(ldddev->node))
+		ldddev->node = -1;
+	ret = device_register(&ldddev->dev);
+	if (ret)
+		return ret;
+	return device_create_file(&ldddev->dev, &dev_attr_node);
 }
 EXPORT_SYMBOL(register_ldd_device);
 
 void unregister_ldd_device(struct ldd_device *ldddev)
 {
+	device_remove_file(&ldddev->dev, &dev_attr_node);
 	device_unregister(&ldddev->dev);
 }
 EXPORT_SYMBOL(unregister_ldd_device);
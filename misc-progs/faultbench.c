@@ -0,0 +1,168 @@
+/*
+ * faultbench.c -- page-fault cost of mapped scullp and scullv devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * Each device is filled, mapped, and read one byte per page, in order
+ * (or at random, with "-r"). scullv is run three times: one page per
+ * fault, the default fault-around and the "sequential" advice. The
+ * time is what tells them apart: getrusage counts the pages that
+ * fault-around brings in as minor faults too, since they go through the
+ * same fault path, just without the trap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* From scullv/scullv.h, which can't be included in user space */
+#define SCULLV_IOC_MAGIC  'K'
+#define SCULLV_IOCTADVICE  _IO(SCULLV_IOC_MAGIC,  13)
+#define SCULLV_ADV_NORMAL     0
+#define SCULLV_ADV_RANDOM     1
+#define SCULLV_ADV_SEQUENTIAL 2
+
+static struct run {
+	char *name, *dev;
+	int advice; /* -1: not scullv */
+} runs[] = {
+	{ "scullp",             "/dev/scullp0", -1 },
+	{ "scullv",             "/dev/scullv0", SCULLV_ADV_RANDOM },
+	{ "scullv fault-around","/dev/scullv0", SCULLV_ADV_NORMAL },
+	{ "scullv sequential",  "/dev/scullv0", SCULLV_ADV_SEQUENTIAL },
+};
+#define NRUNS (sizeof(runs) / sizeof(runs[0]))
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static long minflt(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+/* Truncate the device and fill it with "size" bytes */
+static int fill(const char *dev, long size)
+{
+	int fd = open(dev, O_WRONLY);
+	char *buf = malloc(1 << 20);
+	long done = 0;
+	int n;
+
+	if (fd < 0 || !buf) {
+		perror(dev);
+		return -1;
+	}
+	memset(buf, 'x', 1 << 20);
+	while (done < size) {
+		n = write(fd, buf, size - done > (1 << 20) ? (1 << 20) : size - done);
+		if (n <= 0) {
+			perror("write");
+			return -1;
+		}
+		done += n;
+	}
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	long size = 64 << 20, npages, i, faults, *order;
+	int c, fd, random = 0;
+	volatile char sum = 0; /* so that the reads are done */
+	char *map;
+	double t;
+
+	while ((c = getopt(argc, argv, "s:r")) != -1) {
+		switch (c) {
+		case 's':
+			size = strtol(optarg, NULL, 0) << 20;
+			break;
+		case 'r':
+			random = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s megabytes] [-r]\n", argv[0]);
+			exit(1);
+		}
+	}
+	npages = size / getpagesize();
+	order = malloc(npages * sizeof(*order));
+	if (npages < 1 || !order) {
+		fprintf(stderr, "%s: bad arguments\n", argv[0]);
+		exit(1);
+	}
+	for (i = 0; i < npages; i++)
+		order[i] = i;
+	if (random) {
+		srand(1);
+		for (i = npages - 1; i > 0; i--) {
+			long j = rand() % (i + 1), tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+	}
+
+	printf("%li MB, %s access\n", size >> 20, random ? "random" : "sequential");
+	printf("%-20s %10s %10s %10s %10s\n", "", "seconds", "MB/s",
+			"minflt", "us/page");
+	for (c = 0; c < NRUNS; c++) {
+		if (fill(runs[c].dev, size))
+			continue;
+		fd = open(runs[c].dev, O_RDONLY);
+		if (fd < 0) {
+			perror(runs[c].dev);
+			continue;
+		}
+		if (runs[c].advice >= 0 &&
+				ioctl(fd, SCULLV_IOCTADVICE, runs[c].advice) < 0) {
+			perror("SCULLV_IOCTADVICE");
+			close(fd);
+			continue;
+		}
+		map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			continue;
+		}
+		faults = minflt();
+		t = now();
+		for (i = 0; i < npages; i++)
+			sum += map[order[i] * getpagesize()];
+		t = now() - t;
+		faults = minflt() - faults;
+		printf("%-20s %10.3f %10.1f %10li %10.3f\n", runs[c].name, t,
+				(size >> 20) / t, faults, t * 1e6 / npages);
+		munmap(map, size);
+		close(fd);
+	}
+	exit(0);
+}
@@ -32,12 +32,22 @@ int main(int argc, char **argv)
     FILE *f;
     unsigned long offset, len;
     void *address;
+    int populate = 0;
 
+    /*
+     * "-p" maps shared and with MAP_POPULATE, so that a driver with a
+     * populate method (scullp) sets up the whole mapping at once
+     */
+    if (argc > 1 && !strcmp(argv[1], "-p")) {
+        populate = 1;
+        argv[1] = argv[0]; /* shift, keeping the name */
+        argv++; argc--;
+    }
     if (argc !=4
        || sscanf(argv[2],"%li", &offset) != 1
        || sscanf(argv[3],"%li", &len) != 1) {
-        fprintf(stderr, "%s: Usage \"%s <file> <offset> <len>\"\n", argv[0],
-                argv[0]);
+        fprintf(stderr, "%s: Usage \"%s [-p] <file> <offset> <len>\"\n",
+                argv[0], argv[0]);
         exit(1);
     }
     /* the offset might be big (e.g., PCI devices), but conversion trims it */
@@ -50,12 +60,17 @@ int main(int argc, char **argv)
 
     fname=argv[1];
 
-    if (!(f=fopen(fname,"r"))) {
+    if (!(f=fopen(fname, populate ? "r+" : "r"))) {
         fprintf(stderr, "%s: %s: %s\n", argv[0], fname, strerror(errno));
         exit(1);
     }
 
-    address=mmap(0, len, PROT_READ, MAP_FILE | MAP_PRIVATE, fileno(f), offset);
+    if (populate)
+        address=mmap(0, len, PROT_READ, MAP_FILE | MAP_SHARED | MAP_POPULATE,
+                     fileno(f), offset);
+    else
+        address=mmap(0, len, PROT_READ, MAP_FILE | MAP_PRIVATE, fileno(f),
+                     offset);
 
     if (address == (void *)-1) {
         fprintf(stderr,"%s: mmap(): %s\n",argv[0],strerror(errno));
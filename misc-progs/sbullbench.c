@@ -0,0 +1,141 @@
+/*
+ * sbullbench.c -- parallel random I/O on an sbull disk
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * 1, 2, 4 ... up to "-t" threads do O_DIRECT reads (or writes, with
+ * "-w") of "-b" bytes at random aligned offsets for a few seconds each,
+ * so the requests reach the driver without going through the page
+ * cache. Load sbull with request_mode=3 (striped) and compare with the
+ * other modes: only the striped one should scale with the CPUs.
+ */
+
+#define _GNU_SOURCE /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/fs.h> /* BLKGETSIZE */
+
+static char *dev = "/dev/sbulla";
+static unsigned long size;
+static int bsize = 4096, seconds = 2, writing;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *worker(void *arg)
+{
+	long *count = arg;
+	unsigned int seed = (unsigned long) arg;
+	void *buf;
+	int fd = open(dev, (writing ? O_WRONLY : O_RDONLY) | O_DIRECT);
+
+	if (fd < 0 || posix_memalign(&buf, 4096, bsize)) {
+		perror(dev);
+		exit(1);
+	}
+	memset(buf, 'x', bsize);
+	while (!stop) {
+		off_t pos = (off_t)(rand_r(&seed) % (size / bsize)) * bsize;
+		if ((writing ? pwrite(fd, buf, bsize, pos) :
+				pread(fd, buf, bsize, pos)) != bsize) {
+			perror(writing ? "pwrite" : "pread");
+			exit(1);
+		}
+		(*count)++;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int maxthreads = 16, nthreads, i, c, fd;
+	unsigned long sectors;
+	pthread_t *threads;
+	long *counts, total;
+	double t, base = 0;
+
+	while ((c = getopt(argc, argv, "t:b:d:w")) != -1) {
+		switch (c) {
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		case 'b':
+			bsize = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			writing = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t maxthreads] [-b bytes] "
+					"[-d seconds] [-w] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE, &sectors) < 0) {
+		perror(dev);
+		exit(1);
+	}
+	close(fd);
+	size = sectors * 512;
+	if (maxthreads < 1 || bsize < 512 || bsize % 512 || size < bsize) {
+		fprintf(stderr, "%s: bad arguments\n", argv[0]);
+		exit(1);
+	}
+
+	threads = calloc(maxthreads, sizeof(*threads));
+	counts = calloc(maxthreads, sizeof(*counts));
+	printf("%s: %lu KB, %i-byte %s\n", dev, size >> 10, bsize,
+			writing ? "writes" : "reads");
+	printf("%8s %12s %10s %8s\n", "threads", "ops/s", "MB/s", "scaling");
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+		stop = 0;
+		memset(counts, 0, maxthreads * sizeof(*counts));
+		t = now();
+		for (i = 0; i < nthreads; i++)
+			pthread_create(threads + i, NULL, worker, counts + i);
+		sleep(seconds);
+		stop = 1;
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		t = now() - t;
+		for (total = i = 0; i < nthreads; i++)
+			total += counts[i];
+		if (nthreads == 1)
+			base = total / t;
+		printf("%8i %12.0f %10.1f %8.2f\n", nthreads, total / t,
+				total / t * bsize / (1 << 20), total / t / base);
+	}
+	exit(0);
+}
@@ -0,0 +1,121 @@
+/*
+ * scullbench.c -- read/write throughput of a scull device by buffer size
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * For each buffer size, from 512 bytes to 4MB, the device is truncated
+ * and written, then read back. With "-v" the buffer is split into
+ * several segments and moved with writev/readv instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+#define MAXBUF (4 << 20)
+#define NSEGS  16
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Move "total" bytes in "bsize" chunks; return seconds, count syscalls */
+static double run(const char *dev, int writing, char *buf, int bsize,
+		long total, int vector, long *calls)
+{
+	struct iovec iov[NSEGS];
+	int fd, i, n;
+	long done = 0;
+	double t;
+
+	fd = open(dev, writing ? O_WRONLY : O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	for (i = 0; i < NSEGS; i++) {
+		iov[i].iov_base = buf + i * (bsize / NSEGS);
+		iov[i].iov_len = bsize / NSEGS;
+	}
+	*calls = 0;
+	t = now();
+	while (done < total) {
+		if (vector)
+			n = writing ? writev(fd, iov, NSEGS) : readv(fd, iov, NSEGS);
+		else
+			n = writing ? write(fd, buf, bsize) : read(fd, buf, bsize);
+		(*calls)++;
+		if (n < 0) {
+			perror(writing ? "write" : "read");
+			exit(1);
+		}
+		if (n == 0)
+			break; /* EOF or a hole */
+		done += n;
+	}
+	t = now() - t;
+	close(fd);
+	return t;
+}
+
+int main(int argc, char **argv)
+{
+	long total = 64 << 20, wcalls, rcalls;
+	int bsize, vector = 0, c;
+	char *dev = "/dev/scull0", *buf;
+	double tw, tr;
+
+	while ((c = getopt(argc, argv, "s:v")) != -1) {
+		switch (c) {
+		case 's':
+			total = strtol(optarg, NULL, 0) << 20;
+			break;
+		case 'v':
+			vector = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s megabytes] [-v] [device]\n",
+					argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+
+	buf = malloc(MAXBUF);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 'x', MAXBUF);
+
+	printf("%8s %10s %10s %10s %10s\n", "bufsize", "write MB/s",
+			"calls", "read MB/s", "calls");
+	for (bsize = vector ? 512 * NSEGS : 512; bsize <= MAXBUF; bsize *= 2) {
+		tw = run(dev, 1, buf, bsize, total, vector, &wcalls);
+		tr = run(dev, 0, buf, bsize, total, vector, &rcalls);
+		printf("%8i %10.1f %10li %10.1f %10li\n", bsize,
+				(total >> 20) / tw, wcalls,
+				(total >> 20) / tr, rcalls);
+	}
+	exit(0);
+}
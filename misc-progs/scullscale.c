@@ -0,0 +1,182 @@
+/*
+ * scullscale.c -- concurrent readers on one scull device
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * The device is filled once, then 1, 2, 4 ... up to "-t" threads read
+ * it at random offsets for a few seconds each. With readers that don't
+ * serialize, the aggregate rate should grow with the number of CPUs.
+ * "-w" adds one thread that keeps rewriting the device meanwhile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+static char *dev = "/dev/scull0";
+static long size = 16 << 20;
+static int bsize = 4096, seconds = 2;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *reader(void *arg)
+{
+	long *count = arg;
+	unsigned int seed = (unsigned long) arg;
+	char *buf = malloc(bsize);
+	int fd = open(dev, O_RDONLY);
+
+	if (fd < 0 || !buf) {
+		perror(dev);
+		exit(1);
+	}
+	while (!stop) {
+		off_t pos = (rand_r(&seed) % (size / bsize)) * bsize;
+		if (pread(fd, buf, bsize, pos) < 0) {
+			perror("pread");
+			exit(1);
+		}
+		(*count)++;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	char *buf = malloc(bsize);
+	int fd = open(dev, O_RDWR); /* not O_WRONLY: that would trim */
+	long pos = 0;
+
+	if (fd < 0 || !buf) {
+		perror(dev);
+		exit(1);
+	}
+	memset(buf, 'w', bsize);
+	while (!stop) {
+		if (pwrite(fd, buf, bsize, pos) < 0) {
+			perror("pwrite");
+			exit(1);
+		}
+		pos = (pos + bsize) % size;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int fill(void)
+{
+	int fd = open(dev, O_WRONLY);
+	char *buf = malloc(1 << 20);
+	long done = 0;
+	int n;
+
+	if (fd < 0 || !buf) {
+		perror(dev);
+		return -1;
+	}
+	memset(buf, 'x', 1 << 20);
+	while (done < size) {
+		n = write(fd, buf, size - done > (1 << 20) ? (1 << 20) : size - done);
+		if (n <= 0) {
+			perror("write");
+			return -1;
+		}
+		done += n;
+	}
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int maxthreads = 32, withwriter = 0, nthreads, i, c;
+	pthread_t *threads, wthread;
+	long *counts, total;
+	double t, base = 0;
+
+	while ((c = getopt(argc, argv, "t:s:b:d:w")) != -1) {
+		switch (c) {
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		case 's':
+			size = strtol(optarg, NULL, 0) << 20;
+			break;
+		case 'b':
+			bsize = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			withwriter = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t maxthreads] [-s megabytes] "
+					"[-b bytes] [-d seconds] [-w] [device]\n",
+					argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+	if (maxthreads < 1 || bsize < 1 || size < bsize) {
+		fprintf(stderr, "%s: bad arguments\n", argv[0]);
+		exit(1);
+	}
+	if (fill())
+		exit(1);
+
+	threads = calloc(maxthreads, sizeof(*threads));
+	counts = calloc(maxthreads, sizeof(*counts));
+	printf("%8s %12s %8s\n", "threads", "reads/s", "scaling");
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+		stop = 0;
+		memset(counts, 0, maxthreads * sizeof(*counts));
+		if (withwriter)
+			pthread_create(&wthread, NULL, writer, NULL);
+		t = now();
+		for (i = 0; i < nthreads; i++)
+			pthread_create(threads + i, NULL, reader, counts + i);
+		sleep(seconds);
+		stop = 1;
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		t = now() - t;
+		if (withwriter)
+			pthread_join(wthread, NULL);
+		for (total = i = 0; i < nthreads; i++)
+			total += counts[i];
+		if (nthreads == 1)
+			base = total / t;
+		printf("%8i %12.0f %8.2f\n", nthreads, total / t,
+				total / t / base);
+	}
+	exit(0);
+}
@@ -0,0 +1,201 @@
+/*
+ * seekbench.c -- random-offset reads from scull, list vs radix lookup
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+/*
+ * The same device is filled and read twice, once for each value of
+ * the scull_radix parameter. The parameter is only looked at when
+ * the device is trimmed, so we write it and then reopen write-only.
+ * Must run as root; the old parameter value is put back at exit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+/* From scull/scull.h, which can't be included in user space */
+#define SCULL_IOC_MAGIC  'k'
+#define SCULL_IOCTQSET    _IO(SCULL_IOC_MAGIC,   4)
+#define SCULL_IOCQQSET    _IO(SCULL_IOC_MAGIC,   8)
+
+#define RADIX_PARAM "/sys/module/scull/parameters/scull_radix"
+
+static char buffer[65536];
+
+static int set_param(const char *name, int value)
+{
+	FILE *f = fopen(name, "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%i\n", value);
+	return fclose(f);
+}
+
+static int get_param(const char *name)
+{
+	FILE *f = fopen(name, "r");
+	int value = 0;
+
+	if (!f)
+		return -1;
+	if (fscanf(f, "%i", &value) != 1)
+		value = -1;
+	fclose(f);
+	return value;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Truncate the device and fill it with "size" bytes */
+static int fill(const char *dev, long size)
+{
+	int fd = open(dev, O_WRONLY);
+	long done = 0;
+	int n;
+
+	if (fd < 0) {
+		perror(dev);
+		return -1;
+	}
+	memset(buffer, 'x', sizeof(buffer));
+	while (done < size) {
+		n = size - done > sizeof(buffer) ? sizeof(buffer) : size - done;
+		n = write(fd, buffer, n);
+		if (n < 0) {
+			perror("write");
+			close(fd);
+			return -1;
+		}
+		done += n;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Do "nops" reads of "bsize" bytes at random offsets, return seconds */
+static double seekread(const char *dev, long size, int nops, int bsize)
+{
+	int fd = open(dev, O_RDONLY), i;
+	double t;
+
+	if (fd < 0) {
+		perror(dev);
+		return -1;
+	}
+	srand(1); /* the same offsets for both runs */
+	t = now();
+	for (i = 0; i < nops; i++) {
+		off_t pos = ((double)rand() / RAND_MAX) * (size - bsize);
+		if (pread(fd, buffer, bsize, pos) < 0) {
+			perror("pread");
+			break;
+		}
+	}
+	t = now() - t;
+	close(fd);
+	return t;
+}
+
+int main(int argc, char **argv)
+{
+	long size = 64 << 20;
+	int nops = 100000, bsize = 512, qset = 0, oldqset = 0;
+	int radix, oldradix, c;
+	char *dev = "/dev/scull0";
+	double t[2];
+
+	while ((c = getopt(argc, argv, "s:n:b:q:")) != -1) {
+		switch (c) {
+		case 's':
+			size = strtol(optarg, NULL, 0) << 20;
+			break;
+		case 'n':
+			nops = atoi(optarg);
+			break;
+		case 'b':
+			bsize = atoi(optarg);
+			break;
+		case 'q':
+			qset = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s megabytes] [-n reads] "
+					"[-b bytes] [-q qset] [device]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+	if (bsize > sizeof(buffer))
+		bsize = sizeof(buffer);
+
+	oldradix = get_param(RADIX_PARAM);
+	if (oldradix < 0) {
+		perror(RADIX_PARAM);
+		exit(1);
+	}
+	if (qset) { /* smaller qsets mean a longer list to walk */
+		c = open(dev, O_RDONLY);
+		if (c < 0) {
+			perror(dev);
+			exit(1);
+		}
+		oldqset = ioctl(c, SCULL_IOCQQSET);
+		if (ioctl(c, SCULL_IOCTQSET, qset) < 0) {
+			perror("SCULL_IOCTQSET");
+			exit(1);
+		}
+		close(c);
+	}
+
+	for (radix = 0; radix < 2; radix++) {
+		if (set_param(RADIX_PARAM, radix)) {
+			perror(RADIX_PARAM);
+			break;
+		}
+		if (fill(dev, size))
+			break;
+		t[radix] = seekread(dev, size, nops, bsize);
+		if (t[radix] < 0)
+			break;
+		printf("%-5s: %i reads of %i bytes in %li MB: %.3fs, "
+				"%.2f us/read\n", radix ? "radix" : "list",
+				nops, bsize, size >> 20, t[radix],
+				t[radix] * 1e6 / nops);
+	}
+	if (radix == 2)
+		printf("speedup: %.2fx\n", t[0] / t[1]);
+
+	set_param(RADIX_PARAM, oldradix);
+	if (qset) {
+		c = open(dev, O_RDONLY);
+		if (c >= 0) {
+			ioctl(c, SCULL_IOCTQSET, oldqset);
+			close(c);
+		}
+	}
+	exit(radix == 2 ? 0 : 1);
+}
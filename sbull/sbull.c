@@ -18,10 +18,21 @@
 #include <linux/hdreg.h>	/* HDIO_GETGEO */
 #include <linux/kdev_t.h>
 #include <linux/vmalloc.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>	/* kmap_atomic() */
+#include <linux/pagemap.h>	/* page_cache_release() */
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>	/* invalidate_bdev */
 #include <linux/bio.h>
+#include <linux/time.h>		/* do_gettimeofday() */
+#include <linux/proc_fs.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <asm/div64.h>		/* do_div() */
+
+#include "sbull.h"		/* the ioctl commands */
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -33,6 +44,8 @@ static int nsectors = 1024;	/* How big the drive is */
 module_param(nsectors, int, 0);
 static int ndevices = 4;
 module_param(ndevices, int, 0);
+static int zero_reclaim = 1;	/* free pages that are written to zeros */
+module_param(zero_reclaim, int, 0);
 
 /*
  * The different "request modes" we can use.
@@ -41,10 +54,42 @@ enum {
 	RM_SIMPLE  = 0,	/* The extra-simple request function */
 	RM_FULL    = 1,	/* The full-blown version */
 	RM_NOQUEUE = 2,	/* Use make_request */
+	RM_STRIPED = 3,	/* make_request, locking per stripe */
+	RM_ASYNC   = 4,	/* A thread completes requests, like a disk */
 };
 static int request_mode = RM_SIMPLE;
 module_param(request_mode, int, 0);
 
+/*
+ * The RM_ASYNC disk model. At most async_depth requests are taken off
+ * the queue at a time (the rest wait in the elevator), and each one
+ * costs async_latency microseconds, plus up to async_seek for a seek
+ * across the whole disk (less for shorter ones, none if sequential),
+ * plus its size at async_bandwidth KB/s (0 means no limit). They can
+ * be changed at run time.
+ */
+static int async_depth = 32;
+module_param(async_depth, int, S_IRUGO | S_IWUSR);
+static int async_latency = 100;
+module_param(async_latency, int, S_IRUGO | S_IWUSR);
+static int async_seek = 8000;
+module_param(async_seek, int, S_IRUGO | S_IWUSR);
+static int async_bandwidth = 50*1024;
+module_param(async_bandwidth, int, S_IRUGO | S_IWUSR);
+
+/*
+ * In RM_STRIPED mode the device is cut in stripes of this many (kernel)
+ * sectors, each with its own lock, so that CPUs working on different
+ * parts of the disk don't meet. The locks are hashed: a few per CPU are
+ * enough, and a lock per stripe would take more memory than a sparse
+ * device does. With stripe_lock=0 there's no locking
+ * at all; only do that if the users never overlap their I/O.
+ */
+static int stripe_sectors = 64;
+module_param(stripe_sectors, int, 0);
+static int stripe_lock = 1;
+module_param(stripe_lock, int, 0);
+
 /*
  * Minor number and partition management.
  */
@@ -63,39 +108,544 @@ module_param(request_mode, int, 0);
  */
 #define INVALIDATE_DELAY	30*HZ
 
+/*
+ * Buckets in the latency histograms, log2 of microseconds.
+ */
+#define SBULL_LAT_BUCKETS	20
+
+/*
+ * Snapshots per device. Each one is a disk without partitions, with
+ * minor numbers after all the devices' (see sbull_snap_minor).
+ */
+#define SBULL_SNAPS	8
+
+/*
+ * Statistics. Each CPU counts in its own copy, so keeping them costs
+ * no shared cache lines; they are only summed when read. Everything
+ * in "c" can be reset, but not "inflight": a request can be counted
+ * in on one CPU and out on another, so only the sum makes sense.
+ */
+struct sbull_counters {
+	unsigned long ios[2];		/* reads, writes */
+	unsigned long sectors[2];
+	unsigned long merges[2];	/* bios merged into a request */
+	unsigned long lat_req[SBULL_LAT_BUCKETS]; /* request modes */
+	unsigned long lat_bio[SBULL_LAT_BUCKETS]; /* make_request modes */
+};
+
+struct sbull_stats {
+	struct sbull_counters c;
+	long inflight;
+};
+
+/*
+ * One stripe; each lock gets its own cache line, or the CPUs would
+ * still fight over it.
+ */
+struct sbull_stripe {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * The backing store is split in shards by page index, each with its
+ * own lock; in RM_STRIPED mode a shard is a stripe (or a page, if the
+ * stripes are smaller), so CPUs on different stripes use different
+ * locks for the store too.
+ */
+#define SBULL_SHARDS	16	/* a power of two */
+
+struct sbull_shard {
+	rwlock_t lock;
+	unsigned long npages;		/* in all the layers */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * A snapshot: a frozen layer, seen through a read-only disk of its own.
+ */
+struct sbull_snap {
+	struct sbull_dev *dev;
+	struct sbull_layer *layer;
+	struct request_queue *queue;
+	struct gendisk *gd;
+	int users;
+};
+
 /*
  * The internal representation of our device.
  */
 struct sbull_dev {
-        int size;                       /* Device size in sectors */
-        u8 *data;                       /* The data array */
+        u64 size;                       /* Device size in bytes */
+        struct sbull_layer *top;        /* The data, page by page */
+        struct sbull_shard shards[SBULL_SHARDS]; /* Lock the layers */
+        int shard_shift;                /* log2 of pages per shard */
+        struct sbull_snap *snaps[SBULL_SNAPS]; /* Oldest first */
+        int nsnaps;
+        struct semaphore snap_sem;      /* Serializes snapshot ioctls */
         short users;                    /* How many users */
         short media_change;             /* Flag a media change? */
         spinlock_t lock;                /* For mutual exclusion */
         struct request_queue *queue;    /* The device request queue */
         struct gendisk *gd;             /* The gendisk structure */
         struct timer_list timer;        /* For simulated media changes */
+        struct sbull_stripe *stripes;   /* RM_STRIPED locks */
+        unsigned long stripe_mask;      /* how many of them, less one */
+        int stripe_shift;               /* log2 of sectors per stripe */
+        struct sbull_stats *stats;      /* Per-CPU statistics */
+        struct sbull_kobj *kobj;        /* Where sysfs shows them */
+        struct list_head async_list;    /* RM_ASYNC requests in flight */
+        int async_inflight;             /* and how many there are */
+        wait_queue_head_t async_wait;   /* the thread sleeps here */
+        struct task_struct *async_task; /* the completion thread */
+        unsigned long head;             /* where the simulated head is */
+        u64 busy_until;                 /* simulated time, in us */
 };
 
 static struct sbull_dev *Devices = NULL;
 
 /*
- * Handle an I/O request.
+ * The backing store is sparse: a radix tree of pages, indexed by page
+ * offset in the device. A page shows up on the first write to it, and
+ * missing pages read as zeros.
+ *
+ * For snapshots, the store is a stack of such trees, or "layers". A
+ * snapshot freezes the top layer and puts an empty one on top of it;
+ * writes always go to the top, copying a page up from below first if
+ * needed, and a read takes the first page it finds going down. So the
+ * layers are shared, and only the pages written since are copied.
+ *
+ * Each layer has a tree per shard, and a shard's lock covers its trees
+ * in all the layers. Readers hold a reference to the page while they
+ * copy, so it can't be freed under them. Writers copy with the lock
+ * held for reading. Changing dev->top or the stack of layers takes
+ * every shard lock for writing, so no write can be halfway into a
+ * layer a snapshot freezes; holding any one shard lock is enough to
+ * look at dev->top.
  */
-static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
+struct sbull_layer {
+	struct radix_tree_root pages[SBULL_SHARDS];
+	unsigned long npages[SBULL_SHARDS];
+	struct sbull_layer *below;
+	struct list_head list;		/* waiting to be freed */
+};
+
+static inline struct sbull_shard *sbull_shard(struct sbull_dev *dev,
+		unsigned long index)
+{
+	return dev->shards + ((index >> dev->shard_shift) & (SBULL_SHARDS - 1));
+}
+
+static inline struct radix_tree_root *sbull_tree(struct sbull_dev *dev,
+		struct sbull_layer *layer, unsigned long index)
+{
+	return layer->pages + (sbull_shard(dev, index) - dev->shards);
+}
+
+static void sbull_lock_layers(struct sbull_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < SBULL_SHARDS; i++)
+		write_lock(&dev->shards[i].lock);
+}
+
+static void sbull_unlock_layers(struct sbull_dev *dev)
+{
+	int i;
+
+	for (i = SBULL_SHARDS - 1; i >= 0; i--)
+		write_unlock(&dev->shards[i].lock);
+}
+
+static unsigned long sbull_npages(struct sbull_dev *dev)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = 0; i < SBULL_SHARDS; i++)
+		n += dev->shards[i].npages;
+	return n;
+}
+
+static struct sbull_layer *sbull_new_layer(struct sbull_layer *below)
+{
+	struct sbull_layer *layer = kmalloc(sizeof(*layer), GFP_KERNEL);
+	int i;
+
+	if (layer) {
+		for (i = 0; i < SBULL_SHARDS; i++) {
+			INIT_RADIX_TREE(&layer->pages[i], GFP_ATOMIC);
+			layer->npages[i] = 0;
+		}
+		layer->below = below;
+	}
+	return layer;
+}
+
+/*
+ * Find the page that "layer" (and those below it) have at "index",
+ * with a reference. A NULL layer means the top one. Called with
+ * the lock of the page's shard held.
+ */
+static struct page *__sbull_find_page(struct sbull_dev *dev,
+		struct sbull_layer *layer, unsigned long index)
+{
+	struct page *page;
+
+	for (layer = layer ? layer : dev->top; layer; layer = layer->below) {
+		page = radix_tree_lookup(sbull_tree(dev, layer, index), index);
+		if (page) {
+			get_page(page);
+			return page;
+		}
+	}
+	return NULL;
+}
+
+static struct page *sbull_find_page(struct sbull_dev *dev,
+		struct sbull_layer *layer, unsigned long index)
+{
+	struct sbull_shard *shard = sbull_shard(dev, index);
+	struct page *page;
+
+	read_lock(&shard->lock);
+	page = __sbull_find_page(dev, layer, index);
+	read_unlock(&shard->lock);
+	return page;
+}
+
+/*
+ * copy_highpage and clear_highpage use KM_USER0, which sbull_xfer_bio
+ * may be holding for a bio page while we get here; so the store has
+ * its own. The second slot is an interrupt one, which is only safe
+ * with interrupts off, as in bvec_kmap_irq.
+ */
+static void sbull_copy_page(struct page *to, struct page *from)
+{
+	unsigned long flags;
+	char *vto, *vfrom;
+
+	local_irq_save(flags);
+	vto = kmap_atomic(to, KM_USER1);
+	vfrom = kmap_atomic(from, KM_BIO_SRC_IRQ);
+	copy_page(vto, vfrom);
+	kunmap_atomic(vfrom, KM_BIO_SRC_IRQ);
+	kunmap_atomic(vto, KM_USER1);
+	local_irq_restore(flags);
+}
+
+static void sbull_clear_page(struct page *page)
+{
+	char *kaddr = kmap_atomic(page, KM_USER1);
+
+	clear_page(kaddr);
+	kunmap_atomic(kaddr, KM_USER1);
+}
+
+/*
+ * Give the top layer a page at "index", unless somebody else just did.
+ * It starts as a copy of the page below, if any, or zeroed. The tree
+ * nodes are always allocated atomically, under the lock, since
+ * radix_tree_preload isn't exported to modules.
+ */
+static int sbull_add_page(struct sbull_dev *dev, unsigned long index, int gfp)
+{
+	struct sbull_shard *shard = sbull_shard(dev, index);
+	struct page *page, *below;
+	int err = 0;
+
+	page = alloc_page(gfp | __GFP_HIGHMEM);
+	if (page == NULL)
+		return -ENOMEM;
+	page->index = index; /* for sbull_free_layer */
+	write_lock(&shard->lock);
+	if (radix_tree_lookup(sbull_tree(dev, dev->top, index), index)) {
+		__free_page(page);
+		goto out;
+	}
+	below = __sbull_find_page(dev, dev->top->below, index);
+	if (below) {
+		sbull_copy_page(page, below);
+		put_page(below);
+	} else
+		sbull_clear_page(page);
+	err = radix_tree_insert(sbull_tree(dev, dev->top, index), index, page);
+	if (err)
+		__free_page(page);
+	else {
+		dev->top->npages[shard - dev->shards]++;
+		shard->npages++;
+	}
+  out:
+	write_unlock(&shard->lock);
+	return err;
+}
+
+/*
+ * Somebody wrote zeros to this page; if it's all zeros now, nobody
+ * is reading it and there's nothing below for it to hide, give it
+ * back. The check is done under the write lock, so no writer can be
+ * halfway through the page.
+ */
+static void sbull_reclaim_page(struct sbull_dev *dev, unsigned long index)
+{
+	struct sbull_shard *shard = sbull_shard(dev, index);
+	struct page *page, *below;
+	unsigned long *p;
+	int i;
+
+	write_lock(&shard->lock);
+	page = radix_tree_lookup(sbull_tree(dev, dev->top, index), index);
+	if (page == NULL || page_count(page) != 1)
+		goto out; /* 1 is the tree's reference */
+	below = __sbull_find_page(dev, dev->top->below, index);
+	if (below) {
+		put_page(below);
+		goto out;
+	}
+	p = kmap_atomic(page, KM_USER1);
+	for (i = 0; i < PAGE_SIZE/sizeof(long); i++)
+		if (p[i])
+			break;
+	kunmap_atomic(p, KM_USER1);
+	if (i == PAGE_SIZE/sizeof(long)) {
+		radix_tree_delete(sbull_tree(dev, dev->top, index), index);
+		dev->top->npages[shard - dev->shards]--;
+		shard->npages--;
+		page_cache_release(page);
+	}
+  out:
+	write_unlock(&shard->lock);
+}
+
+static int sbull_is_zero(char *buffer, unsigned long nbytes)
+{
+	while (nbytes--)
+		if (*buffer++)
+			return 0;
+	return 1;
+}
+
+/*
+ * Free a layer that nobody can reach any more, and its pages; readers
+ * still holding a page keep it until they are done.
+ */
+static void sbull_free_layer(struct sbull_layer *layer)
+{
+	struct page *pages[16];
+	unsigned long index;
+	int i, n, shard;
+
+	for (shard = 0; shard < SBULL_SHARDS; shard++) {
+		index = 0;
+		while ((n = radix_tree_gang_lookup(&layer->pages[shard],
+						(void **) pages, index, 16)) > 0) {
+			for (i = 0; i < n; i++) {
+				index = pages[i]->index;
+				radix_tree_delete(&layer->pages[shard], index);
+				page_cache_release(pages[i]);
+			}
+			index++;
+			cond_resched();
+		}
+	}
+	kfree(layer);
+}
+
+/*
+ * Layers dropped by a rollback are freed in the background, so that
+ * the rollback itself doesn't depend on how much was written.
+ */
+static LIST_HEAD(sbull_dead_layers);
+static spinlock_t sbull_dead_lock = SPIN_LOCK_UNLOCKED;
+
+static void sbull_free_dead(void *unused)
+{
+	struct sbull_layer *layer;
+
+	spin_lock(&sbull_dead_lock);
+	while (!list_empty(&sbull_dead_layers)) {
+		layer = list_entry(sbull_dead_layers.next, struct sbull_layer,
+				list);
+		list_del(&layer->list);
+		spin_unlock(&sbull_dead_lock);
+		sbull_free_layer(layer);
+		spin_lock(&sbull_dead_lock);
+	}
+	spin_unlock(&sbull_dead_lock);
+}
+static DECLARE_WORK(sbull_dead_work, sbull_free_dead, NULL);
+
+/*
+ * Free the whole backing store, at media change and unload time; for
+ * a media change, "fresh" is the empty layer to go on with. There are
+ * no snapshots left by then.
+ */
+static void sbull_free_pages(struct sbull_dev *dev, struct sbull_layer *fresh)
+{
+	struct sbull_layer *layer, *below;
+	int i;
+
+	sbull_lock_layers(dev);
+	layer = dev->top;
+	dev->top = fresh;
+	for (i = 0; i < SBULL_SHARDS; i++)
+		dev->shards[i].npages = 0;
+	sbull_unlock_layers(dev);
+	for (; layer; layer = below) {
+		below = layer->below;
+		sbull_free_layer(layer);
+	}
+}
+
+/*
+ * Make sure that the pages behind a range of sectors exist, before a
+ * write that can't sleep. Used by the make_request modes.
+ */
+static int sbull_populate(struct sbull_dev *dev, sector_t sector,
+		unsigned long nsect)
+{
+	unsigned long index = sector >> (PAGE_SHIFT - 9);
+	unsigned long last = (sector + nsect - 1) >> (PAGE_SHIFT - 9);
+	struct sbull_shard *shard;
+	struct page *page;
+	int err;
+
+	if (nsect == 0)
+		return 0;
+	for (; index <= last; index++) {
+		shard = sbull_shard(dev, index);
+		read_lock(&shard->lock);
+		page = radix_tree_lookup(sbull_tree(dev, dev->top, index), index);
+		read_unlock(&shard->lock);
+		if (page == NULL && (err = sbull_add_page(dev, index, GFP_NOIO)))
+			return err;
+	}
+	return 0;
+}
+
+static u64 sbull_now(void)
+{
+	struct timeval tv;
+
+	do_gettimeofday(&tv);
+	return (u64) tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+/*
+ * Count an I/O in and out. The start time is kept as an unsigned
+ * long, which is enough for the difference to come out right.
+ */
+static unsigned long sbull_stat_start(struct sbull_dev *dev)
+{
+	per_cpu_ptr(dev->stats, get_cpu())->inflight++;
+	put_cpu();
+	return (unsigned long) sbull_now();
+}
+
+static void sbull_stat_done(struct sbull_dev *dev, int rw,
+		unsigned long sectors, int merges, unsigned long start, int bio)
+{
+	struct sbull_stats *st;
+	unsigned long usecs = (unsigned long) sbull_now() - start;
+	int bucket = 0;
+
+	while (usecs >= (1UL << bucket) && bucket < SBULL_LAT_BUCKETS - 1)
+		bucket++;
+	st = per_cpu_ptr(dev->stats, get_cpu());
+	st->c.ios[rw]++;
+	st->c.sectors[rw] += sectors;
+	st->c.merges[rw] += merges;
+	if (bio)
+		st->c.lat_bio[bucket]++;
+	else
+		st->c.lat_req[bucket]++;
+	st->inflight--;
+	put_cpu();
+}
+
+static int sbull_rq_merges(struct request *req)
+{
+	struct bio *bio;
+	int n = 0;
+
+	rq_for_each_bio(bio, req)
+		n++;
+	return n - 1;
+}
+
+/*
+ * Handle an I/O request. Snapshots are read through "layer"; the
+ * device itself passes NULL, for whatever layer is on top.
+ */
+static int sbull_layer_transfer(struct sbull_dev *dev,
+		struct sbull_layer *layer, unsigned long sector,
 		unsigned long nsect, char *buffer, int write)
 {
-	unsigned long offset = sector*KERNEL_SECTOR_SIZE;
+	u64 offset = (u64) sector*KERNEL_SECTOR_SIZE;
 	unsigned long nbytes = nsect*KERNEL_SECTOR_SIZE;
+	unsigned long index, poff, chunk;
+	struct sbull_shard *shard;
+	struct page *page;
+	char *kaddr;
+	int zero, err;
 
 	if ((offset + nbytes) > dev->size) {
-		printk (KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
-		return;
+		printk (KERN_NOTICE "Beyond-end write (%lld %ld)\n",
+				(long long) offset, nbytes);
+		return -EIO;
 	}
-	if (write)
-		memcpy(dev->data + offset, buffer, nbytes);
-	else
-		memcpy(buffer, dev->data + offset, nbytes);
+	while (nbytes) {
+		index = offset >> PAGE_SHIFT;
+		poff = offset & ~PAGE_MASK;
+		chunk = min(nbytes, PAGE_SIZE - poff);
+		if (!write) {
+			page = sbull_find_page(dev, layer, index);
+			if (page) {
+				kaddr = kmap_atomic(page, KM_USER1);
+				memcpy(buffer, kaddr + poff, chunk);
+				kunmap_atomic(kaddr, KM_USER1);
+				page_cache_release(page);
+			} else
+				memset(buffer, 0, chunk); /* a hole */
+			goto next;
+		}
+		zero = zero_reclaim && sbull_is_zero(buffer, chunk);
+		shard = sbull_shard(dev, index);
+	  again:
+		read_lock(&shard->lock);
+		page = radix_tree_lookup(sbull_tree(dev, dev->top, index), index);
+		if (page == NULL) {
+			if (zero && !(page = __sbull_find_page(dev, NULL, index))) {
+				/* zeros into a hole: nothing to do */
+				read_unlock(&shard->lock);
+				goto next;
+			}
+			if (page)
+				put_page(page);
+			read_unlock(&shard->lock);
+			err = sbull_add_page(dev, index, GFP_ATOMIC);
+			if (err)
+				return err;
+			goto again;
+		}
+		kaddr = kmap_atomic(page, KM_USER1);
+		memcpy(kaddr + poff, buffer, chunk);
+		kunmap_atomic(kaddr, KM_USER1);
+		read_unlock(&shard->lock);
+		if (zero)
+			sbull_reclaim_page(dev, index);
+	  next:
+		offset += chunk;
+		buffer += chunk;
+		nbytes -= chunk;
+	}
+	return 0;
+}
+
+static int sbull_transfer(struct sbull_dev *dev, unsigned long sector,
+		unsigned long nsect, char *buffer, int write)
+{
+	return sbull_layer_transfer(dev, NULL, sector, nsect, buffer, write);
 }
 
 /*
@@ -107,6 +657,9 @@ static void sbull_request(request_queue_t *q)
 
 	while ((req = elv_next_request(q)) != NULL) {
 		struct sbull_dev *dev = req->rq_disk->private_data;
+		unsigned long start;
+		int status;
+
 		if (! blk_fs_request(req)) {
 			printk (KERN_NOTICE "Skip non-fs request\n");
 			end_request(req, 0);
@@ -116,45 +669,144 @@ static void sbull_request(request_queue_t *q)
     //    			dev - Devices, rq_data_dir(req),
     //    			req->sector, req->current_nr_sectors,
     //    			req->flags);
-		sbull_transfer(dev, req->sector, req->current_nr_sectors,
-				req->buffer, rq_data_dir(req));
-		end_request(req, 1);
+		start = sbull_stat_start(dev);
+		status = sbull_transfer(dev, req->sector,
+				req->current_nr_sectors, req->buffer,
+				rq_data_dir(req));
+		sbull_stat_done(dev, rq_data_dir(req), req->current_nr_sectors,
+				0, start, 0);
+		end_request(req, status == 0);
+	}
+}
+
+
+/*
+ * The striped version of sbull_transfer: a transfer is split at the
+ * stripe boundaries and only the stripes it touches are locked.
+ */
+static int sbull_striped_transfer(struct sbull_dev *dev, unsigned long sector,
+		unsigned long nsect, char *buffer, int write)
+{
+	unsigned long stripe, n;
+	int status;
+
+	while (nsect) {
+		stripe = sector >> dev->stripe_shift;
+		n = ((stripe + 1) << dev->stripe_shift) - sector;
+		if (n > nsect)
+			n = nsect;
+		if (stripe_lock)
+			spin_lock(&dev->stripes[stripe & dev->stripe_mask].lock);
+		status = sbull_transfer(dev, sector, n, buffer, write);
+		if (stripe_lock)
+			spin_unlock(&dev->stripes[stripe & dev->stripe_mask].lock);
+		if (status)
+			return status;
+		sector += n;
+		nsect -= n;
+		buffer += n*KERNEL_SECTOR_SIZE;
 	}
+	return 0;
 }
 
+/*
+ * Moving bios. Segments in lowmem need no mapping, and when one starts
+ * right where the previous one ended in memory (as is often the case
+ * with big, merged requests) they are copied together: a "run" is the
+ * stretch of contiguous memory not transferred yet. Highmem segments
+ * are mapped and done one at a time.
+ */
+struct sbull_run {
+	sector_t sector;	/* where the run goes on the disk */
+	char *start;		/* and where it is in memory */
+	unsigned long len;
+	int write;
+	int status;
+	struct sbull_layer *layer;	/* reading a snapshot */
+};
+
+static void sbull_run_flush(struct sbull_dev *dev, struct sbull_run *run)
+{
+	if (run->len && !run->status && run->layer)
+		run->status = sbull_layer_transfer(dev, run->layer,
+				run->sector, run->len/KERNEL_SECTOR_SIZE,
+				run->start, 0);
+	else if (run->len && !run->status)
+		run->status = (dev->stripes ? sbull_striped_transfer :
+				sbull_transfer)(dev, run->sector,
+				run->len/KERNEL_SECTOR_SIZE, run->start,
+				run->write);
+	run->sector += run->len/KERNEL_SECTOR_SIZE;
+	run->len = 0;
+}
 
 /*
- * Transfer a single BIO.
+ * Transfer a single BIO, or add it to the current run.
  */
-static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
+static void sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio,
+		struct sbull_run *run)
 {
 	int i;
 	struct bio_vec *bvec;
-	sector_t sector = bio->bi_sector;
+	char *buffer;
 
-	/* Do each segment independently. */
+	if (run->sector + run->len/KERNEL_SECTOR_SIZE != bio->bi_sector) {
+		sbull_run_flush(dev, run);
+		run->sector = bio->bi_sector;
+	}
 	bio_for_each_segment(bvec, bio, i) {
-		char *buffer = __bio_kmap_atomic(bio, i, KM_USER0);
-		sbull_transfer(dev, sector, bio_cur_sectors(bio),
-				buffer, bio_data_dir(bio) == WRITE);
-		sector += bio_cur_sectors(bio);
-		__bio_kunmap_atomic(bio, KM_USER0);
+		if (PageHighMem(bvec->bv_page)) {
+			sbull_run_flush(dev, run);
+			buffer = __bio_kmap_atomic(bio, i, KM_USER0);
+			run->start = buffer;
+			run->len = bvec->bv_len;
+			sbull_run_flush(dev, run);
+			__bio_kunmap_atomic(buffer, KM_USER0);
+			continue;
+		}
+		buffer = page_address(bvec->bv_page) + bvec->bv_offset;
+		if (run->len && run->start + run->len == buffer) {
+			run->len += bvec->bv_len;
+			continue;
+		}
+		sbull_run_flush(dev, run);
+		run->start = buffer;
+		run->len = bvec->bv_len;
 	}
-	return 0; /* Always "succeed" */
+}
+
+static int sbull_xfer_one_bio(struct sbull_dev *dev, struct bio *bio)
+{
+	struct sbull_run run = {
+		.sector = bio->bi_sector,
+		.write = bio_data_dir(bio) == WRITE,
+	};
+
+	sbull_xfer_bio(dev, bio, &run);
+	sbull_run_flush(dev, &run);
+	return run.status;
 }
 
 /*
- * Transfer a full request.
+ * Transfer a full request; its bios are contiguous on the disk, so a
+ * run can span them.
  */
 static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 {
+	struct sbull_run run = {
+		.sector = req->sector,
+		.write = rq_data_dir(req) == WRITE,
+	};
 	struct bio *bio;
 	int nsect = 0;
     
 	rq_for_each_bio(bio, req) {
-		sbull_xfer_bio(dev, bio);
+		sbull_xfer_bio(dev, bio, &run);
 		nsect += bio->bi_size/KERNEL_SECTOR_SIZE;
 	}
+	sbull_run_flush(dev, &run);
+	if (run.status)
+		printk (KERN_NOTICE "sbull: transfer failed (%d)\n", run.status);
 	return nsect;
 }
 
@@ -166,8 +818,9 @@ static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 static void sbull_full_request(request_queue_t *q)
 {
 	struct request *req;
-	int sectors_xferred;
+	int sectors_xferred, merges;
 	struct sbull_dev *dev = q->queuedata;
+	unsigned long start;
 
 	while ((req = elv_next_request(q)) != NULL) {
 		if (! blk_fs_request(req)) {
@@ -175,7 +828,11 @@ static void sbull_full_request(request_queue_t *q)
 			end_request(req, 0);
 			continue;
 		}
+		start = sbull_stat_start(dev);
+		merges = sbull_rq_merges(req);
 		sectors_xferred = sbull_xfer_request(dev, req);
+		sbull_stat_done(dev, rq_data_dir(req), sectors_xferred,
+				merges, start, 0);
 		if (! end_that_request_first(req, 1, sectors_xferred)) {
 			blkdev_dequeue_request(req);
 			end_that_request_last(req);
@@ -191,12 +848,184 @@ static void sbull_full_request(request_queue_t *q)
 static int sbull_make_request(request_queue_t *q, struct bio *bio)
 {
 	struct sbull_dev *dev = q->queuedata;
-	int status;
+	unsigned long start = sbull_stat_start(dev);
+	int status = 0;
+
+	/* We can sleep here, so allocate what a write needs up front */
+	if (bio_data_dir(bio) == WRITE)
+		status = sbull_populate(dev, bio->bi_sector, bio_sectors(bio));
+	if (!status)
+		status = sbull_xfer_one_bio(dev, bio);
+	sbull_stat_done(dev, bio_data_dir(bio), bio_sectors(bio), 0, start, 1);
+	bio_endio(bio, bio->bi_size, status);
+	return 0;
+}
+
+/*
+ * The striped mode is still make_request, so each bio is handled on
+ * the CPU that submitted it; sbull_xfer_bio picks the striped transfer.
+ */
+static int sbull_striped_make_request(request_queue_t *q, struct bio *bio)
+{
+	struct sbull_dev *dev = q->queuedata;
+	sector_t sector = bio->bi_sector;
+	unsigned long start;
+	int status = 0;
 
-	status = sbull_xfer_bio(dev, bio);
+	if (((u64) (sector + bio_sectors(bio)) << 9) > dev->size) {
+		bio_endio(bio, bio->bi_size, -EIO);
+		return 0;
+	}
+	start = sbull_stat_start(dev);
+	if (bio_data_dir(bio) == WRITE)
+		status = sbull_populate(dev, sector, bio_sectors(bio));
+	if (!status)
+		status = sbull_xfer_one_bio(dev, bio);
+	sbull_stat_done(dev, bio_data_dir(bio), bio_sectors(bio), 0, start, 1);
 	bio_endio(bio, bio->bi_size, status);
 	return 0;
 }
+/*
+ * The asynchronous mode. The request function only moves requests to
+ * async_list, and a thread per device does the work, waiting as long
+ * as the model says each request takes before completing it. The
+ * model keeps its own clock in microseconds, and we only sleep for
+ * whole jiffies: a request may complete a little early, but the clock
+ * stays right, and so does the throughput over time.
+ */
+static void sbull_async_request(request_queue_t *q)
+{
+	struct sbull_dev *dev = q->queuedata;
+	struct request *req;
+	int depth = max(async_depth, 1); /* it's writable: 0 would hang */
+
+	while (dev->async_inflight < depth &&
+			(req = elv_next_request(q)) != NULL) {
+		if (! blk_fs_request(req)) {
+			printk (KERN_NOTICE "Skip non-fs request\n");
+			end_request(req, 0);
+			continue;
+		}
+		blkdev_dequeue_request(req);
+		/* fs requests leave "special" to the driver */
+		req->special = (void *) sbull_stat_start(dev);
+		list_add_tail(&req->queuelist, &dev->async_list);
+		dev->async_inflight++;
+		wake_up(&dev->async_wait);
+	}
+}
+
+/*
+ * How long this request takes the simulated disk, in microseconds.
+ */
+static unsigned long sbull_model(struct sbull_dev *dev, struct request *req)
+{
+	unsigned long us = async_latency, dist;
+	unsigned long sectors = dev->size >> 9;
+	u64 xfer;
+
+	if (req->sector != dev->head) {
+		dist = req->sector > dev->head ? req->sector - dev->head :
+			dev->head - req->sector;
+		us += async_seek/16 + (async_seek - async_seek/16) *
+			(dist/(sectors/1024 + 1))/1024;
+	}
+	if (async_bandwidth > 0) {
+		/* KB * 10^6 overflows 32 bits past 4 MB */
+		xfer = (u64) (req->nr_sectors/2) * 1000000;
+		do_div(xfer, async_bandwidth);
+		us += (unsigned long) xfer;
+	}
+	dev->head = req->sector + req->nr_sectors;
+	return us;
+}
+
+static int sbull_async_thread(void *data)
+{
+	struct sbull_dev *dev = data;
+	struct request *req;
+	u64 now, done;
+	int sectors, merges;
+
+	while (1) {
+		wait_event_interruptible(dev->async_wait,
+				!list_empty(&dev->async_list) ||
+				kthread_should_stop());
+		spin_lock_irq(&dev->lock);
+		if (list_empty(&dev->async_list)) {
+			spin_unlock_irq(&dev->lock);
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+		req = list_entry(dev->async_list.next, struct request,
+				queuelist);
+		list_del_init(&req->queuelist);
+		spin_unlock_irq(&dev->lock);
+
+		/* Let simulated time pass, then do the transfer */
+		now = sbull_now();
+		done = max(now, dev->busy_until) + sbull_model(dev, req);
+		dev->busy_until = done;
+		if (done > now + 1000) {
+			set_current_state(TASK_UNINTERRUPTIBLE);
+			schedule_timeout(msecs_to_jiffies(
+					(unsigned long) (done - now)/1000));
+		}
+		merges = sbull_rq_merges(req);
+		sectors = sbull_xfer_request(dev, req);
+		sbull_stat_done(dev, rq_data_dir(req), sectors, merges,
+				(unsigned long) req->special, 0);
+
+		spin_lock_irq(&dev->lock);
+		if (! end_that_request_first(req, 1, sectors))
+			end_that_request_last(req);
+		dev->async_inflight--;
+		sbull_async_request(dev->queue); /* room for another one */
+		spin_unlock_irq(&dev->lock);
+	}
+	return 0;
+}
+
+static int sbull_setup_async(struct sbull_dev *dev, int which)
+{
+	INIT_LIST_HEAD(&dev->async_list);
+	init_waitqueue_head(&dev->async_wait);
+	dev->async_task = kthread_run(sbull_async_thread, dev, "sbull%c",
+			which + 'a');
+	if (IS_ERR(dev->async_task)) {
+		dev->async_task = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Allocate the stripe locks. The stripe size is rounded up to a power
+ * of two so a sector maps to its stripe with a shift, and the number
+ * of locks, 4 per CPU, so a stripe maps to its lock with a mask.
+ */
+static int sbull_setup_stripes(struct sbull_dev *dev)
+{
+	unsigned long i, nlocks = 1;
+
+	if (stripe_sectors < 1)
+		stripe_sectors = 1;
+	dev->stripe_shift = 0;
+	while ((1 << dev->stripe_shift) < stripe_sectors)
+		dev->stripe_shift++;
+	if (dev->stripe_shift > PAGE_SHIFT - 9)
+		dev->shard_shift = dev->stripe_shift - (PAGE_SHIFT - 9);
+	while (nlocks < 4*NR_CPUS)
+		nlocks <<= 1;
+	dev->stripe_mask = nlocks - 1;
+	dev->stripes = vmalloc(nlocks*sizeof(struct sbull_stripe));
+	if (dev->stripes == NULL)
+		return -ENOMEM;
+	for (i = 0; i < nlocks; i++)
+		spin_lock_init(&dev->stripes[i].lock);
+	return 0;
+}
 
 
 /*
@@ -250,10 +1079,14 @@ int sbull_media_changed(struct gendisk *gd)
 int sbull_revalidate(struct gendisk *gd)
 {
 	struct sbull_dev *dev = gd->private_data;
+	struct sbull_layer *fresh;
 	
 	if (dev->media_change) {
+		fresh = sbull_new_layer(NULL);
+		if (fresh == NULL)
+			return -ENOMEM;
 		dev->media_change = 0;
-		memset (dev->data, 0, dev->size);
+		sbull_free_pages(dev, fresh);
 	}
 	return 0;
 }
@@ -267,13 +1100,217 @@ void sbull_invalidate(unsigned long ldev)
 	struct sbull_dev *dev = (struct sbull_dev *) ldev;
 
 	spin_lock(&dev->lock);
-	if (dev->users || !dev->data) 
+	if (dev->users) 
 		printk (KERN_WARNING "sbull: timer sanity check failed\n");
-	else
+	else if (!dev->nsnaps) /* snapshots keep the media in */
 		dev->media_change = 1;
 	spin_unlock(&dev->lock);
 }
 
+/*
+ * Snapshots. Each one is a read-only disk of its own, which reads its
+ * frozen layer (and those below) through a make_request queue,
+ * whatever the request mode of the device is.
+ */
+static int sbull_snap_make_request(request_queue_t *q, struct bio *bio)
+{
+	struct sbull_snap *snap = q->queuedata;
+	struct sbull_run run = {
+		.sector = bio->bi_sector,
+		.layer = snap->layer,
+	};
+
+	if (bio_data_dir(bio) == WRITE) {
+		bio_endio(bio, bio->bi_size, -EROFS);
+		return 0;
+	}
+	sbull_xfer_bio(snap->dev, bio, &run);
+	sbull_run_flush(snap->dev, &run);
+	bio_endio(bio, bio->bi_size, run.status);
+	return 0;
+}
+
+static int sbull_snap_open(struct inode *inode, struct file *filp)
+{
+	struct sbull_snap *snap = inode->i_bdev->bd_disk->private_data;
+
+	if (filp->f_mode & FMODE_WRITE)
+		return -EROFS;
+	filp->private_data = snap->dev; /* for HDIO_GETGEO */
+	spin_lock(&snap->dev->lock);
+	snap->users++;
+	spin_unlock(&snap->dev->lock);
+	return 0;
+}
+
+static int sbull_snap_release(struct inode *inode, struct file *filp)
+{
+	struct sbull_snap *snap = inode->i_bdev->bd_disk->private_data;
+
+	spin_lock(&snap->dev->lock);
+	snap->users--;
+	spin_unlock(&snap->dev->lock);
+	return 0;
+}
+
+int sbull_ioctl (struct inode *inode, struct file *filp,
+                 unsigned int cmd, unsigned long arg);
+
+static struct block_device_operations sbull_snap_ops = {
+	.owner           = THIS_MODULE,
+	.open 	         = sbull_snap_open,
+	.release 	 = sbull_snap_release,
+	.ioctl	         = sbull_ioctl
+};
+
+/*
+ * Snapshot "n" of device "which" has this minor: after all the minors
+ * of the devices themselves.
+ */
+static int sbull_snap_minor(int which, int n)
+{
+	return (ndevices + which)*SBULL_MINORS + n;
+}
+
+static void sbull_snap_free(struct sbull_snap *snap)
+{
+	if (snap->gd) {
+		if (snap->gd->flags & GENHD_FL_UP)
+			del_gendisk(snap->gd);
+		put_disk(snap->gd);
+	}
+	if (snap->queue)
+		blk_put_queue(snap->queue);
+	kfree(snap);
+}
+
+/*
+ * Take a snapshot: whatever it takes to set up its disk, the data
+ * itself is only an empty layer pushed on top. What the caller has
+ * cached is written out first, so it's in the snapshot.
+ */
+static int sbull_snapshot(struct sbull_dev *dev, struct block_device *bdev)
+{
+	struct sbull_snap *snap;
+	struct sbull_layer *top;
+	int n = dev->nsnaps, which = dev - Devices;
+
+	if (n == SBULL_SNAPS)
+		return -ENOSPC;
+	snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap == NULL)
+		return -ENOMEM;
+	memset(snap, 0, sizeof(*snap));
+	snap->dev = dev;
+	snap->queue = blk_alloc_queue(GFP_KERNEL);
+	snap->gd = alloc_disk(1);
+	top = sbull_new_layer(NULL);
+	if (!snap->queue || !snap->gd || !top) {
+		if (top)
+			kfree(top);
+		sbull_snap_free(snap);
+		return -ENOMEM;
+	}
+	blk_queue_make_request(snap->queue, sbull_snap_make_request);
+	blk_queue_hardsect_size(snap->queue, hardsect_size);
+	snap->queue->queuedata = snap;
+	snap->gd->major = sbull_major;
+	snap->gd->first_minor = sbull_snap_minor(which, n);
+	snap->gd->fops = &sbull_snap_ops;
+	snap->gd->queue = snap->queue;
+	snap->gd->private_data = snap;
+	snprintf (snap->gd->disk_name, 32, "sbull%cs%d", which + 'a', n);
+	set_capacity(snap->gd, dev->size >> 9);
+	set_disk_ro(snap->gd, 1);
+
+	fsync_bdev(bdev);
+	sbull_lock_layers(dev);
+	top->below = dev->top;
+	snap->layer = dev->top;
+	dev->top = top;
+	sbull_unlock_layers(dev);
+	dev->snaps[n] = snap;
+	dev->nsnaps++;
+	add_disk(snap->gd);
+	return n;
+}
+
+/*
+ * Go back to snapshot "n": put an empty layer right on top of its own,
+ * and let the ones above go, with the newer snapshots. The pages go
+ * back in the background. Nobody else may have the device open, since
+ * everything they have cached is now wrong.
+ */
+static int sbull_rollback(struct sbull_dev *dev, struct block_device *bdev,
+		int n)
+{
+	struct sbull_layer *top, *layer, *below;
+	int i, busy;
+
+	if (n < 0 || n >= dev->nsnaps)
+		return -EINVAL;
+	spin_lock(&dev->lock);
+	busy = dev->users > 1;
+	for (i = n + 1; i < dev->nsnaps; i++)
+		busy |= dev->snaps[i]->users;
+	spin_unlock(&dev->lock);
+	if (busy)
+		return -EBUSY;
+	top = sbull_new_layer(dev->snaps[n]->layer);
+	if (top == NULL)
+		return -ENOMEM;
+
+	fsync_bdev(bdev); /* so nothing dirty lands after the switch */
+	sbull_lock_layers(dev);
+	layer = dev->top;
+	dev->top = top;
+	for (below = layer; below != dev->snaps[n]->layer; below = below->below)
+		for (i = 0; i < SBULL_SHARDS; i++)
+			dev->shards[i].npages -= below->npages[i];
+	sbull_unlock_layers(dev);
+	invalidate_bdev(bdev, 0);
+
+	for (i = dev->nsnaps - 1; i > n; i--) {
+		sbull_snap_free(dev->snaps[i]);
+		dev->snaps[i] = NULL;
+	}
+	dev->nsnaps = n + 1;
+	spin_lock(&sbull_dead_lock);
+	for (; layer != dev->snaps[n]->layer; layer = below) {
+		below = layer->below;
+		list_add_tail(&layer->list, &sbull_dead_layers);
+	}
+	spin_unlock(&sbull_dead_lock);
+	schedule_work(&sbull_dead_work);
+	return 0;
+}
+
+static int sbull_snap_ioctl(struct sbull_dev *dev, struct block_device *bdev,
+		unsigned int cmd, unsigned long arg)
+{
+	int retval;
+
+	if (bdev->bd_disk != dev->gd)
+		return -ENOTTY; /* not on the snapshots themselves */
+	if (cmd != SBULL_IOCQSNAPS && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (down_interruptible(&dev->snap_sem))
+		return -ERESTARTSYS;
+	switch(cmd) {
+	    case SBULL_IOCSNAP:
+		retval = sbull_snapshot(dev, bdev);
+		break;
+	    case SBULL_IOCROLLBACK:
+		retval = sbull_rollback(dev, bdev, arg);
+		break;
+	    default: /* SBULL_IOCQSNAPS */
+		retval = dev->nsnaps;
+		break;
+	}
+	up(&dev->snap_sem);
+	return retval;
+}
+
 /*
  * The ioctl() implementation
  */
@@ -293,7 +1330,7 @@ int sbull_ioctl (struct inode *inode, struct file *filp,
 		 * and calculate the corresponding number of cylinders.  We set the
 		 * start of data at sector four.
 		 */
-		size = dev->size*(hardsect_size/KERNEL_SECTOR_SIZE);
+		size = get_capacity(dev->gd);
 		geo.cylinders = (size & ~0x3f) >> 6;
 		geo.heads = 4;
 		geo.sectors = 16;
@@ -301,6 +1338,11 @@ int sbull_ioctl (struct inode *inode, struct file *filp,
 		if (copy_to_user((void __user *) arg, &geo, sizeof(geo)))
 			return -EFAULT;
 		return 0;
+
+	    case SBULL_IOCSNAP:		/* take a snapshot, return its number */
+	    case SBULL_IOCROLLBACK:	/* back to snapshot number "arg" */
+	    case SBULL_IOCQSNAPS:	/* how many snapshots are there */
+		return sbull_snap_ioctl(dev, inode->i_bdev, cmd, arg);
 	}
 
 	return -ENOTTY; /* unknown command */
@@ -321,22 +1363,206 @@ static struct block_device_operations sbull_ops = {
 };
 
 
+/*
+ * The /proc/sbull file: memory in use. The statistics are in sysfs.
+ */
+static int sbull_read_proc(char *buf, char **start, off_t offset,
+		int count, int *eof, void *data)
+{
+	int i, len = 0;
+	int limit = count - 80; /* Don't print more than this */
+
+	for (i = 0; i < ndevices && len <= limit; i++) {
+		struct sbull_dev *dev = Devices + i;
+
+		len += sprintf(buf + len, "sbull%c: %li pages of %li\n",
+				i + 'a', sbull_npages(dev),
+				(long) (dev->size >> PAGE_SHIFT));
+	}
+	*eof = 1;
+	return len;
+}
+
+
+/*
+ * The statistics in sysfs, in /sys/block/sbullX/sbull. The gendisk's
+ * own attributes can't be written, so we hang a kobject of our own
+ * under it: "stat" has the counters, the "latency_" files have the
+ * histograms (the upper bound of each bucket in microseconds, then
+ * the count), and writing anything to "reset" clears them.
+ */
+struct sbull_kobj {
+	struct kobject kobj;
+	struct sbull_dev *dev;
+};
+
+#define to_sbull_dev(k) (container_of(k, struct sbull_kobj, kobj)->dev)
+
+struct sbull_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct sbull_dev *dev, char *buf);
+	ssize_t (*store)(struct sbull_dev *dev, const char *buf, size_t count);
+};
+
+static void sbull_stats_sum(struct sbull_dev *dev, struct sbull_counters *sum,
+		long *inflight)
+{
+	struct sbull_stats *st;
+	unsigned long *from, *to;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	*inflight = 0;
+	for_each_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		from = (unsigned long *) &st->c;
+		to = (unsigned long *) sum;
+		for (i = 0; i < sizeof(*sum)/sizeof(long); i++)
+			to[i] += from[i];
+		*inflight += st->inflight;
+	}
+}
+
+static ssize_t sbull_stat_show(struct sbull_dev *dev, char *buf)
+{
+	struct sbull_counters sum;
+	long inflight;
+
+	sbull_stats_sum(dev, &sum, &inflight);
+	return sprintf(buf, "%lu %lu %lu %lu %lu %lu %li\n",
+			sum.ios[READ], sum.merges[READ], sum.sectors[READ],
+			sum.ios[WRITE], sum.merges[WRITE], sum.sectors[WRITE],
+			inflight);
+}
+
+static ssize_t sbull_hist_show(unsigned long *hist, char *buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < SBULL_LAT_BUCKETS - 1; i++)
+		len += sprintf(buf + len, "%lu %lu\n", 1UL << i, hist[i]);
+	len += sprintf(buf + len, "inf %lu\n", hist[i]);
+	return len;
+}
+
+static ssize_t sbull_lat_req_show(struct sbull_dev *dev, char *buf)
+{
+	struct sbull_counters sum;
+	long inflight;
+
+	sbull_stats_sum(dev, &sum, &inflight);
+	return sbull_hist_show(sum.lat_req, buf);
+}
+
+static ssize_t sbull_lat_bio_show(struct sbull_dev *dev, char *buf)
+{
+	struct sbull_counters sum;
+	long inflight;
+
+	sbull_stats_sum(dev, &sum, &inflight);
+	return sbull_hist_show(sum.lat_bio, buf);
+}
+
+static ssize_t sbull_reset_store(struct sbull_dev *dev, const char *buf,
+		size_t count)
+{
+	int cpu;
+
+	for_each_cpu(cpu)
+		memset(&per_cpu_ptr(dev->stats, cpu)->c, 0,
+				sizeof(struct sbull_counters));
+	return count;
+}
+
+static struct sbull_attribute sbull_attr_stat =
+	__ATTR(stat, S_IRUGO, sbull_stat_show, NULL);
+static struct sbull_attribute sbull_attr_lat_req =
+	__ATTR(latency_request, S_IRUGO, sbull_lat_req_show, NULL);
+static struct sbull_attribute sbull_attr_lat_bio =
+	__ATTR(latency_bio, S_IRUGO, sbull_lat_bio_show, NULL);
+static struct sbull_attribute sbull_attr_reset =
+	__ATTR(reset, S_IWUSR, NULL, sbull_reset_store);
+
+static struct attribute *sbull_default_attrs[] = {
+	&sbull_attr_stat.attr,
+	&sbull_attr_lat_req.attr,
+	&sbull_attr_lat_bio.attr,
+	&sbull_attr_reset.attr,
+	NULL,
+};
+
+static ssize_t sbull_attr_show(struct kobject *kobj, struct attribute *attr,
+		char *buf)
+{
+	struct sbull_attribute *a = container_of(attr, struct sbull_attribute,
+			attr);
+
+	if (!a->show)
+		return -EIO;
+	return a->show(to_sbull_dev(kobj), buf);
+}
+
+static ssize_t sbull_attr_store(struct kobject *kobj, struct attribute *attr,
+		const char *buf, size_t count)
+{
+	struct sbull_attribute *a = container_of(attr, struct sbull_attribute,
+			attr);
+
+	if (!a->store)
+		return -EIO;
+	return a->store(to_sbull_dev(kobj), buf, count);
+}
+
+static struct sysfs_ops sbull_sysfs_ops = {
+	.show	= sbull_attr_show,
+	.store	= sbull_attr_store,
+};
+
+/*
+ * The kobject is allocated apart from the device array, since somebody
+ * may still hold a reference to it after unload has freed the array;
+ * it goes with the last reference. An open attribute holds the module
+ * too, so the device is still there for show and store.
+ */
+static void sbull_kobj_release(struct kobject *kobj)
+{
+	kfree(container_of(kobj, struct sbull_kobj, kobj));
+}
+
+static struct kobj_type sbull_ktype = {
+	.release	= sbull_kobj_release,
+	.sysfs_ops	= &sbull_sysfs_ops,
+	.default_attrs	= sbull_default_attrs,
+};
+
+
 /*
  * Set up our internal device.
  */
 static void setup_device(struct sbull_dev *dev, int which)
 {
+	int i;
+
 	/*
-	 * Get some memory.
+	 * No memory yet: pages come as they are written.
 	 */
 	memset (dev, 0, sizeof (struct sbull_dev));
-	dev->size = nsectors*hardsect_size;
-	dev->data = vmalloc(dev->size);
-	if (dev->data == NULL) {
-		printk (KERN_NOTICE "vmalloc failure.\n");
+	dev->size = (u64) nsectors*hardsect_size;
+	/* before any failure: sbull_exit takes these in sbull_free_pages */
+	for (i = 0; i < SBULL_SHARDS; i++)
+		rwlock_init(&dev->shards[i].lock);
+	dev->top = sbull_new_layer(NULL);
+	if (dev->top == NULL) {
+		printk (KERN_NOTICE "sbull: out of memory\n");
 		return;
 	}
+	init_MUTEX(&dev->snap_sem);
 	spin_lock_init(&dev->lock);
+	dev->stats = alloc_percpu(struct sbull_stats);
+	if (dev->stats == NULL) {
+		printk (KERN_NOTICE "sbull: can't allocate statistics\n");
+		return;
+	}
 	
 	/*
 	 * The timer which "invalidates" the device.
@@ -350,6 +1576,15 @@ static void setup_device(struct sbull_dev *dev, int which)
 	 * make_request function or not.
 	 */
 	switch (request_mode) {
+	    case RM_STRIPED:
+		if (sbull_setup_stripes(dev))
+			goto out_vfree;
+		dev->queue = blk_alloc_queue(GFP_KERNEL);
+		if (dev->queue == NULL)
+			goto out_vfree;
+		blk_queue_make_request(dev->queue, sbull_striped_make_request);
+		break;
+
 	    case RM_NOQUEUE:
 		dev->queue = blk_alloc_queue(GFP_KERNEL);
 		if (dev->queue == NULL)
@@ -363,6 +1598,15 @@ static void setup_device(struct sbull_dev *dev, int which)
 			goto out_vfree;
 		break;
 
+	    case RM_ASYNC:
+		dev->queue = blk_init_queue(sbull_async_request, &dev->lock);
+		if (dev->queue == NULL)
+			goto out_vfree;
+		dev->queue->queuedata = dev;
+		if (sbull_setup_async(dev, which))
+			goto out_vfree;
+		break;
+
 	    default:
 		printk(KERN_NOTICE "Bad request mode %d, using simple\n", request_mode);
         	/* fall into.. */
@@ -389,13 +1633,29 @@ static void setup_device(struct sbull_dev *dev, int which)
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
 	snprintf (dev->gd->disk_name, 32, "sbull%c", which + 'a');
-	set_capacity(dev->gd, nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
+	set_capacity(dev->gd, dev->size >> 9);
 	add_disk(dev->gd);
+
+	dev->kobj = kmalloc(sizeof(struct sbull_kobj), GFP_KERNEL);
+	if (dev->kobj == NULL)
+		return; /* no statistics in sysfs, then */
+	memset(dev->kobj, 0, sizeof(struct sbull_kobj));
+	dev->kobj->dev = dev;
+	kobject_set_name(&dev->kobj->kobj, "sbull");
+	dev->kobj->kobj.parent = &dev->gd->kobj;
+	dev->kobj->kobj.ktype = &sbull_ktype;
+	if (kobject_register(&dev->kobj->kobj)) {
+		/* kobject_add has dropped the parent already */
+		dev->kobj->kobj.parent = NULL;
+		kobject_put(&dev->kobj->kobj); /* frees it */
+		dev->kobj = NULL;
+	}
 	return;
 
   out_vfree:
-	if (dev->data)
-		vfree(dev->data);
+	if (dev->stripes)
+		vfree(dev->stripes);
+	dev->stripes = NULL;
 }
 
 
@@ -419,6 +1679,7 @@ static int __init sbull_init(void)
 		goto out_unregister;
 	for (i = 0; i < ndevices; i++) 
 		setup_device(Devices + i, i);
+	create_proc_read_entry("sbull", 0, NULL, sbull_read_proc, NULL);
     
 	return 0;
 
@@ -429,25 +1690,37 @@ static int __init sbull_init(void)
 
 static void sbull_exit(void)
 {
-	int i;
+	int i, j;
 
+	remove_proc_entry("sbull", NULL);
 	for (i = 0; i < ndevices; i++) {
 		struct sbull_dev *dev = Devices + i;
 
 		del_timer_sync(&dev->timer);
+		for (j = dev->nsnaps - 1; j >= 0; j--)
+			sbull_snap_free(dev->snaps[j]);
+		if (dev->kobj)
+			kobject_unregister(&dev->kobj->kobj);
 		if (dev->gd) {
 			del_gendisk(dev->gd);
 			put_disk(dev->gd);
 		}
+		if (dev->async_task) /* after the disk, which may do I/O */
+			kthread_stop(dev->async_task);
 		if (dev->queue) {
-			if (request_mode == RM_NOQUEUE)
+			if (request_mode == RM_NOQUEUE ||
+					request_mode == RM_STRIPED)
 				blk_put_queue(dev->queue);
 			else
 				blk_cleanup_queue(dev->queue);
 		}
-		if (dev->data)
-			vfree(dev->data);
+		if (dev->stripes)
+			vfree(dev->stripes);
+		sbull_free_pages(dev, NULL);
+		if (dev->stats)
+			free_percpu(dev->stats);
 	}
+	flush_scheduled_work(); /* for the layers of rollbacks */
 	unregister_blkdev(sbull_major, "sbull");
 	kfree(Devices);
 }
@@ -52,6 +52,21 @@
 #define SBULL_HARDSECT 512  /* 2.2 and 2.4 can used different values */
 
 #define SBULLR_MAJOR 0      /* Dynamic major for raw device */
+
+/*
+ * Ioctl definitions, for the snapshots. They only work on the devices
+ * themselves, not on the snapshots; the snapshots are read-only disks
+ * named after the device, such as sbullas0 for the first one of sbulla.
+ *
+ * SNAP takes a snapshot and returns its number, ROLLBACK goes back to
+ * snapshot "arg" (dropping the newer ones), and QSNAPS returns how
+ * many snapshots there are.
+ */
+#define SBULL_IOC_MAGIC  'g'
+
+#define SBULL_IOCSNAP     _IO(SBULL_IOC_MAGIC, 1)
+#define SBULL_IOCROLLBACK _IO(SBULL_IOC_MAGIC, 2)
+#define SBULL_IOCQSNAPS   _IO(SBULL_IOC_MAGIC, 3)
 /*
  * The sbull device is removable: if it is left closed for more than
  * half a minute, it is removed. Thus use a usage count and a
@@ -80,6 +80,8 @@ struct file_operations scull_sngl_fops = {
 	.llseek =     	scull_llseek,
 	.read =       	scull_read,
 	.write =      	scull_write,
+	.readv =      	scull_readv,
+	.writev =     	scull_writev,
 	.ioctl =      	scull_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
@@ -142,6 +144,8 @@ struct file_operations scull_user_fops = {
 	.llseek =     scull_llseek,
 	.read =       scull_read,
 	.write =      scull_write,
+	.readv =      scull_readv,
+	.writev =     scull_writev,
 	.ioctl =      scull_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
@@ -215,6 +219,8 @@ struct file_operations scull_wusr_fops = {
 	.llseek =     scull_llseek,
 	.read =       scull_read,
 	.write =      scull_write,
+	.readv =      scull_readv,
+	.writev =     scull_writev,
 	.ioctl =      scull_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
@@ -261,7 +267,7 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
 	scull_trim(&(lptr->device)); /* initialize it */
-	init_MUTEX(&(lptr->device.sem));
+	init_rwsem(&(lptr->device.sem));
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -314,6 +320,8 @@ struct file_operations scull_priv_fops = {
 	.llseek =   scull_llseek,
 	.read =     scull_read,
 	.write =    scull_write,
+	.readv =    scull_readv,
+	.writev =   scull_writev,
 	.ioctl =    scull_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
@@ -347,7 +355,9 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	/* Initialize the device structure */
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	init_MUTEX(&dev->sem);
+	dev->radix = scull_radix;
+	INIT_RADIX_TREE(&dev->qtree, GFP_KERNEL);
+	init_rwsem(&dev->sem);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
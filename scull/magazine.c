@@ -0,0 +1,305 @@
+/*
+ * magazine.c -- per-CPU caching of quanta and quantum sets
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * Writing a device allocates a quantum (and now and then a qset array)
+ * every few kilobytes, and scull_trim gives them all back. Instead of
+ * going to kmalloc each time, freed objects are kept in "magazines":
+ * each CPU has two of them and works on them with preemption disabled
+ * but no lock. Full and empty magazines are exchanged with a shared
+ * depot, under a spinlock, a whole magazine at a time. Only objects of
+ * the load-time sizes are cached; other sizes go straight to kmalloc.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+
+#include "scull.h"		/* local definitions */
+
+#define SCULL_MAG_ROUNDS 16	/* objects in a magazine */
+
+struct scull_magazine {
+	int rounds;			/* how many objects are loaded */
+	void *objs[SCULL_MAG_ROUNDS];
+	struct list_head list;		/* in the depot */
+};
+
+struct scull_mag_cpu {
+	struct scull_magazine *loaded;	/* allocate from and free to this */
+	struct scull_magazine *prev;	/* and the one used before it */
+	unsigned long hits, misses;
+};
+
+struct scull_mag_class {
+	char *name;
+	size_t size;			/* what size of object we cache */
+	struct scull_mag_cpu *cpu;	/* per-CPU magazines */
+	spinlock_t lock;		/* protects the depot */
+	struct list_head full, empty;	/* the depot */
+	int nfull;
+};
+
+static struct scull_mag_class scull_mag_classes[SCULL_MAG_CLASSES] = {
+	[SCULL_MAG_QUANTUM] = { .name = "quantum" },
+	[SCULL_MAG_QSET] =    { .name = "qset" },
+};
+
+static int scull_mag_depot = SCULL_MAG_DEPOT;	/* full magazines kept */
+module_param(scull_mag_depot, int, S_IRUGO);
+
+static struct scull_magazine *scull_mag_new(int gfp)
+{
+	struct scull_magazine *mag = kmalloc(sizeof(*mag), gfp);
+
+	if (mag)
+		mag->rounds = 0;
+	return mag;
+}
+
+static void scull_mag_empty(struct scull_magazine *mag)
+{
+	while (mag->rounds)
+		kfree(mag->objs[--mag->rounds]);
+}
+
+/*
+ * The loaded magazine is empty: try "prev", then a full one from the
+ * depot, which takes our empty one in exchange.  Preemption is off.
+ */
+static void scull_mag_reload(struct scull_mag_class *mc,
+		struct scull_mag_cpu *pc)
+{
+	struct scull_magazine *mag;
+
+	if (pc->prev->rounds) {
+		mag = pc->prev;
+		pc->prev = pc->loaded;
+		pc->loaded = mag;
+		return;
+	}
+	spin_lock(&mc->lock);
+	if (!list_empty(&mc->full)) {
+		mag = list_entry(mc->full.next, struct scull_magazine, list);
+		list_del(&mag->list);
+		mc->nfull--;
+		list_add(&pc->prev->list, &mc->empty);
+		pc->prev = pc->loaded;
+		pc->loaded = mag;
+	}
+	spin_unlock(&mc->lock);
+}
+
+/*
+ * The loaded magazine is full: try "prev", then push a full one to the
+ * depot and get an empty one. Returns nonzero if there's no room, in
+ * which case the caller just frees the object.  Preemption is off.
+ */
+static int scull_mag_unload(struct scull_mag_class *mc,
+		struct scull_mag_cpu *pc)
+{
+	struct scull_magazine *mag = NULL;
+
+	if (pc->prev->rounds < SCULL_MAG_ROUNDS) {
+		mag = pc->prev;
+		pc->prev = pc->loaded;
+		pc->loaded = mag;
+		return 0;
+	}
+	spin_lock(&mc->lock);
+	if (mc->nfull < scull_mag_depot) {
+		if (!list_empty(&mc->empty)) {
+			mag = list_entry(mc->empty.next, struct scull_magazine,
+					list);
+			list_del(&mag->list);
+		} else
+			mag = scull_mag_new(GFP_ATOMIC);
+		if (mag) {
+			list_add(&pc->prev->list, &mc->full);
+			mc->nfull++;
+			pc->prev = pc->loaded;
+			pc->loaded = mag;
+		}
+	}
+	spin_unlock(&mc->lock);
+	return mag == NULL;
+}
+
+/*
+ * Allocate an object of the given class. It is not cleared.
+ */
+void *scull_mag_alloc(int class, size_t size)
+{
+	struct scull_mag_class *mc = scull_mag_classes + class;
+	struct scull_mag_cpu *pc;
+	void *obj = NULL;
+
+	if (size != mc->size || !mc->cpu)
+		return kmalloc(size, GFP_KERNEL);
+
+	pc = per_cpu_ptr(mc->cpu, get_cpu());
+	if (!pc->loaded->rounds)
+		scull_mag_reload(mc, pc);
+	if (pc->loaded->rounds) {
+		obj = pc->loaded->objs[--pc->loaded->rounds];
+		pc->hits++;
+	} else
+		pc->misses++;
+	put_cpu();
+
+	if (!obj)
+		obj = kmalloc(size, GFP_KERNEL);
+	return obj;
+}
+
+/*
+ * Give back "n" objects at once; NULL entries are skipped, so a whole
+ * qset array can be passed in. This is what scull_trim uses.
+ */
+void scull_mag_free_bulk(int class, void **objs, int n, size_t size)
+{
+	struct scull_mag_class *mc = scull_mag_classes + class;
+	struct scull_mag_cpu *pc;
+	int i;
+
+	if (size != mc->size || !mc->cpu) {
+		for (i = 0; i < n; i++)
+			kfree(objs[i]);
+		return;
+	}
+
+	pc = per_cpu_ptr(mc->cpu, get_cpu());
+	for (i = 0; i < n; i++) {
+		if (!objs[i])
+			continue;
+		if (pc->loaded->rounds == SCULL_MAG_ROUNDS &&
+				scull_mag_unload(mc, pc)) {
+			kfree(objs[i]); /* the depot is full */
+			continue;
+		}
+		pc->loaded->objs[pc->loaded->rounds++] = objs[i];
+	}
+	put_cpu();
+}
+
+void scull_mag_free(int class, void *obj, size_t size)
+{
+	scull_mag_free_bulk(class, &obj, 1, size);
+}
+
+#ifdef SCULL_DEBUG
+/*
+ * Hit rates, for the seq_file in main.c
+ */
+void scull_mag_seq_show(struct seq_file *s)
+{
+	struct scull_mag_class *mc;
+	unsigned long hits, misses;
+	int class, cpu;
+
+	for (class = 0; class < SCULL_MAG_CLASSES; class++) {
+		mc = scull_mag_classes + class;
+		if (!mc->cpu)
+			continue;
+		hits = misses = 0;
+		for_each_cpu(cpu) {
+			hits += per_cpu_ptr(mc->cpu, cpu)->hits;
+			misses += per_cpu_ptr(mc->cpu, cpu)->misses;
+		}
+		seq_printf(s, "Magazine %s (%li bytes): %lu hits, %lu misses"
+				" (%lu%%), %i full in depot\n", mc->name,
+				(long) mc->size, hits, misses,
+				hits + misses ? hits * 100 / (hits + misses) : 0,
+				mc->nfull);
+	}
+}
+#endif
+
+/*
+ * Setup and teardown; cleanup must work on a half-initialized cache.
+ */
+void scull_mag_cleanup(void)
+{
+	struct scull_mag_class *mc;
+	struct scull_magazine *mag, *next;
+	struct scull_mag_cpu *pc;
+	int class, cpu;
+
+	for (class = 0; class < SCULL_MAG_CLASSES; class++) {
+		mc = scull_mag_classes + class;
+		if (!mc->cpu)
+			continue;
+		for_each_cpu(cpu) {
+			pc = per_cpu_ptr(mc->cpu, cpu);
+			if (pc->loaded) {
+				scull_mag_empty(pc->loaded);
+				kfree(pc->loaded);
+			}
+			if (pc->prev) {
+				scull_mag_empty(pc->prev);
+				kfree(pc->prev);
+			}
+		}
+		list_for_each_entry_safe(mag, next, &mc->full, list) {
+			scull_mag_empty(mag);
+			kfree(mag);
+		}
+		list_for_each_entry_safe(mag, next, &mc->empty, list)
+			kfree(mag);
+		free_percpu(mc->cpu);
+		mc->cpu = NULL;
+	}
+}
+
+int scull_mag_init(void)
+{
+	struct scull_mag_class *mc;
+	struct scull_mag_cpu *pc;
+	int class, cpu;
+
+	scull_mag_classes[SCULL_MAG_QUANTUM].size = scull_quantum;
+	scull_mag_classes[SCULL_MAG_QSET].size = scull_qset * sizeof(char *);
+
+	for (class = 0; class < SCULL_MAG_CLASSES; class++) {
+		mc = scull_mag_classes + class;
+		spin_lock_init(&mc->lock);
+		INIT_LIST_HEAD(&mc->full);
+		INIT_LIST_HEAD(&mc->empty);
+		mc->nfull = 0;
+		mc->cpu = alloc_percpu(struct scull_mag_cpu);
+		if (!mc->cpu)
+			goto fail;
+		for_each_cpu(cpu) {
+			pc = per_cpu_ptr(mc->cpu, cpu);
+			pc->loaded = scull_mag_new(GFP_KERNEL);
+			pc->prev = scull_mag_new(GFP_KERNEL);
+			if (!pc->loaded || !pc->prev)
+				goto fail;
+		}
+	}
+	return 0;
+
+  fail:
+	scull_mag_cleanup();
+	return -ENOMEM;
+}
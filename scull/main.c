@@ -28,6 +28,13 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/radix-tree.h>
+#include <linux/uio.h>		/* struct iovec */
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>	/* cond_resched() */
 
 #include <asm/system.h>		/* cli(), *_flags */
 #include <asm/uaccess.h>	/* copy_*_user */
@@ -43,12 +50,16 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_radix =   SCULL_RADIX;	/* index qsets with a radix tree */
+static int scull_reclaim_batch = SCULL_RECLAIM_BATCH; /* items per run */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_radix, int, S_IRUGO | S_IWUSR);
+module_param(scull_reclaim_batch, int, S_IRUGO | S_IWUSR);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -56,30 +67,160 @@ MODULE_LICENSE("Dual BSD/GPL");
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
 
+/*
+ * Truncation is lazy: scull_trim only detaches the list (and its
+ * index) from the device, and a work function frees it later, a few
+ * items at a time, so that opening a large device write-only doesn't
+ * stall everybody while the quanta are freed.
+ */
+struct scull_reclaim {
+	struct scull_qset *data;	/* what is left to free */
+	struct radix_tree_root qtree;	/* its index, if "radix" */
+	unsigned long item;		/* the index of "data" */
+	int quantum, qset, radix;	/* as they were in the device */
+	struct list_head list;
+};
+
+static LIST_HEAD(scull_reclaim_list);
+static spinlock_t scull_reclaim_lock = SPIN_LOCK_UNLOCKED;
+static unsigned long scull_reclaim_pending;	/* items, for /proc */
+static int scull_reclaim_stop;			/* unloading: don't requeue */
+
+static void scull_reclaim(void *unused);
+static DECLARE_WORK(scull_reclaim_work, scull_reclaim, NULL);
+
+/*
+ * Free one item of a detached list. The caller must own "r": either
+ * it has taken it off scull_reclaim_list, or nobody else can see it.
+ */
+static void scull_reclaim_one(struct scull_reclaim *r)
+{
+	struct scull_qset *dptr = r->data;
+
+	if (dptr->data) {
+		/* the quanta go back in one go, then the array */
+		scull_mag_free_bulk(SCULL_MAG_QUANTUM, dptr->data, r->qset,
+				r->quantum);
+		scull_mag_free(SCULL_MAG_QSET, dptr->data,
+				r->qset * sizeof(char *));
+	}
+	if (r->radix)
+		radix_tree_delete(&r->qtree, r->item);
+	r->item++;
+	r->data = dptr->next;
+	kfree(dptr);
+}
+
+/*
+ * Free up to "budget" items; return nonzero if there's more to do.
+ * The work can run on two CPUs at once (a trim elsewhere may queue it
+ * again while it runs), so each list is taken off scull_reclaim_list
+ * while an item of it is freed, and put back at the head after.
+ */
+static int scull_reclaim_some(int budget)
+{
+	struct scull_reclaim *r;
+
+	while (budget-- > 0) {
+		spin_lock(&scull_reclaim_lock);
+		if (list_empty(&scull_reclaim_list)) {
+			spin_unlock(&scull_reclaim_lock);
+			return 0;
+		}
+		r = list_entry(scull_reclaim_list.next, struct scull_reclaim,
+				list);
+		list_del(&r->list);
+		spin_unlock(&scull_reclaim_lock);
+
+		scull_reclaim_one(r);
+
+		spin_lock(&scull_reclaim_lock);
+		scull_reclaim_pending--;
+		if (r->data) {
+			list_add(&r->list, &scull_reclaim_list);
+			r = NULL;
+		}
+		spin_unlock(&scull_reclaim_lock);
+		kfree(r);
+		cond_resched();
+	}
+	return 1;
+}
+
+/*
+ * The work function: a batch at a time, then give the CPU back for
+ * a tick, so that a huge list doesn't take a worker thread over.
+ */
+static void scull_reclaim(void *unused)
+{
+	int more = scull_reclaim_some(scull_reclaim_batch);
+
+	/* under the lock, or the drain could miss the timer we set */
+	spin_lock(&scull_reclaim_lock);
+	if (more && !scull_reclaim_stop)
+		schedule_delayed_work(&scull_reclaim_work, 1);
+	spin_unlock(&scull_reclaim_lock);
+}
+
+/*
+ * At unload time: stop the work function and free everything now.
+ * Once the flag is set nobody arms the timer again, so cancelling it
+ * and then waiting for a run already under way is enough.
+ */
+static void scull_reclaim_drain(void)
+{
+	spin_lock(&scull_reclaim_lock);
+	scull_reclaim_stop = 1;
+	spin_unlock(&scull_reclaim_lock);
+	cancel_delayed_work(&scull_reclaim_work);
+	flush_scheduled_work();
+	while (scull_reclaim_some(INT_MAX))
+		;
+}
+
 /*
  * Empty out the scull device; must be called with the device
- * semaphore held.
+ * semaphore held for writing.  Like quantum and qset, the choice of the qset
+ * index is only picked up here, when the device is empty.
  */
 int scull_trim(struct scull_dev *dev)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
-
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
+	struct scull_reclaim *r = NULL;
+
+	if (dev->data) {
+		r = kmalloc(sizeof(struct scull_reclaim), GFP_KERNEL);
+		if (!r) { /* no memory to be lazy: free it all now */
+			struct scull_reclaim now;
+			now.data = dev->data;
+			now.qtree = dev->qtree;
+			now.item = 0;
+			now.quantum = dev->quantum;
+			now.qset = dev->qset;
+			now.radix = dev->radix;
+			while (now.data)
+				scull_reclaim_one(&now);
 		}
-		next = dptr->next;
-		kfree(dptr);
+	}
+	if (r) {
+		r->data = dev->data;
+		r->qtree = dev->qtree; /* the tree moves with its root */
+		r->item = 0;
+		r->quantum = dev->quantum;
+		r->qset = dev->qset;
+		r->radix = dev->radix;
+		spin_lock(&scull_reclaim_lock);
+		list_add_tail(&r->list, &scull_reclaim_list);
+		scull_reclaim_pending += dev->nqsets;
+		spin_unlock(&scull_reclaim_lock);
+		schedule_work(&scull_reclaim_work);
 	}
 	dev->size = 0;
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
 	dev->data = NULL;
+	dev->nqsets = 0;
+	dev->radix = scull_radix;
+	INIT_RADIX_TREE(&dev->qtree, GFP_KERNEL);
 	return 0;
 }
 #ifdef SCULL_DEBUG /* use proc only if debugging */
@@ -96,8 +237,7 @@ int scull_read_procmem(char *buf, char **start, off_t offset,
 	for (i = 0; i < scull_nr_devs && len <= limit; i++) {
 		struct scull_dev *d = &scull_devices[i];
 		struct scull_qset *qs = d->data;
-		if (down_interruptible(&d->sem))
-			return -ERESTARTSYS;
+		down_read(&d->sem);
 		len += sprintf(buf+len,"\nDevice %i: qset %i, q %i, sz %li\n",
 				i, d->qset, d->quantum, d->size);
 		for (; qs && len <= limit; qs = qs->next) { /* scan the list */
@@ -111,7 +251,7 @@ int scull_read_procmem(char *buf, char **start, off_t offset,
 								j, qs->data[j]);
 				}
 		}
-		up(&scull_devices[i].sem);
+		up_read(&scull_devices[i].sem);
 	}
 	*eof = 1;
 	return len;
@@ -153,11 +293,17 @@ static int scull_seq_show(struct seq_file *s, void *v)
 	struct scull_qset *d;
 	int i;
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+	if (dev == scull_devices) { /* once, before the first device */
+		scull_mag_seq_show(s);
+		seq_printf(s, "Items waiting to be freed: %lu\n",
+				scull_reclaim_pending);
+	}
+	down_read(&dev->sem);
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 			(int) (dev - scull_devices), dev->qset,
 			dev->quantum, dev->size);
+	seq_printf(s, "  %li items, %s lookup\n", dev->nqsets,
+			dev->radix ? "radix" : "list");
 	for (d = dev->data; d; d = d->next) { /* scan the list */
 		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
 		if (d->data && !d->next) /* dump only the last item */
@@ -167,7 +313,7 @@ static int scull_seq_show(struct seq_file *s, void *v)
 							i, d->data[i]);
 			}
 	}
-	up(&dev->sem);
+	up_read(&dev->sem);
 	return 0;
 }
 	
@@ -244,10 +390,9 @@ int scull_open(struct inode *inode, struct file *filp)
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
-			return -ERESTARTSYS;
+		down_write(&dev->sem);
 		scull_trim(dev); /* ignore errors */
-		up(&dev->sem);
+		up_write(&dev->sem);
 	}
 	return 0;          /* success */
 }
@@ -256,6 +401,26 @@ int scull_release(struct inode *inode, struct file *filp)
 {
 	return 0;
 }
+/*
+ * Allocate a new, empty qset to be appended to the list. When the
+ * device is indexed, the new item is also entered in the radix tree.
+ */
+static struct scull_qset *scull_new_qset(struct scull_dev *dev)
+{
+	struct scull_qset *qs;
+
+	qs = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+	if (qs == NULL)
+		return NULL;
+	memset(qs, 0, sizeof(struct scull_qset));
+	if (dev->radix && radix_tree_insert(&dev->qtree, dev->nqsets, qs)) {
+		kfree(qs);
+		return NULL;
+	}
+	dev->nqsets++;
+	return qs;
+}
+
 /*
  * Follow the list
  */
@@ -263,21 +428,30 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 {
 	struct scull_qset *qs = dev->data;
 
+	/*
+	 * If the list is indexed, existing items are found in O(log n),
+	 * and new ones are appended to the last item, not to the head.
+	 */
+	if (dev->radix && dev->nqsets) {
+		if ((unsigned long) n < dev->nqsets)
+			return radix_tree_lookup(&dev->qtree, n);
+		qs = radix_tree_lookup(&dev->qtree, dev->nqsets - 1);
+		n -= dev->nqsets - 1;
+	}
+
         /* Allocate first qset explicitly if need be */
 	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+		qs = dev->data = scull_new_qset(dev);
 		if (qs == NULL)
 			return NULL;  /* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
 	}
 
 	/* Then follow the list */
 	while (n--) {
 		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+			qs->next = scull_new_qset(dev);
 			if (qs->next == NULL)
 				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
 		}
 		qs = qs->next;
 		continue;
@@ -285,104 +459,299 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 	return qs;
 }
 
+/*
+ * Step to the item after "qs", appending one if "qs" is the last.
+ * This avoids a new walk when a transfer crosses items.
+ */
+static struct scull_qset *scull_follow_next(struct scull_dev *dev,
+		struct scull_qset *qs)
+{
+	if (!qs->next)
+		qs->next = scull_new_qset(dev);
+	return qs->next;
+}
+
+/*
+ * Like scull_follow, but never allocates; NULL if there's no such item.
+ * This is what readers use, as they only hold the semaphore for reading.
+ */
+static struct scull_qset *scull_lookup(struct scull_dev *dev, int n)
+{
+	struct scull_qset *qs = dev->data;
+
+	if ((unsigned long) n >= dev->nqsets)
+		return NULL;
+	if (dev->radix)
+		return radix_tree_lookup(&dev->qtree, n);
+	while (n--)
+		qs = qs->next;
+	return qs;
+}
+
 /*
  * Data management: read and write
+ *
+ * Both directions work on an iovec, so that read/write and readv/writev
+ * share the code. The list is followed once, to the position where the
+ * transfer starts; after that the loop moves from quantum to quantum
+ * and from one item to the next, so that a single call can move any
+ * amount of data. The caller holds the device semaphore; readers
+ * never change the list, so they only take it for reading and any
+ * number of them can run at once, while writers hold it exclusively.
  */
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t scull_do_read(struct scull_dev *dev, const struct iovec *iov,
+                unsigned long nr_segs, loff_t *f_pos)
 {
-	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
+	struct scull_qset *dptr;	/* the current listitem */
 	int quantum = dev->quantum, qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
 	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
+	loff_t pos = *f_pos;
+	ssize_t done = 0;
+	unsigned long seg;
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	if (pos >= dev->size)
+		return 0;
 
 	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
+	item = (long)pos / itemsize;
+	rest = (long)pos % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
+	/* find the right position, without extending the list */
+	dptr = scull_lookup(dev, item);
 
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
+	for (seg = 0; seg < nr_segs; seg++) {
+		char __user *buf = iov[seg].iov_base;
+		size_t count = iov[seg].iov_len;
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+		while (count && pos < dev->size) {
+			size_t chunk = min(count, (size_t)(quantum - q_pos));
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+			if (pos + chunk > dev->size)
+				chunk = dev->size - pos;
+			if (s_pos == qset) { /* move on to the next item */
+				s_pos = 0;
+				dptr = dptr ? dptr->next : NULL;
+			}
+			if (dptr == NULL || !dptr->data || ! dptr->data[s_pos]) {
+				/* a hole: it reads as zeros, but stays a hole */
+				if (clear_user(buf, chunk))
+					return done ? done : -EFAULT;
+			} else if (copy_to_user(buf, dptr->data[s_pos] + q_pos, chunk))
+				return done ? done : -EFAULT;
+			buf += chunk;
+			count -= chunk;
+			pos += chunk;
+			done += chunk;
+			*f_pos = pos;
+
+			/* step to the next quantum if this one is done */
+			q_pos += chunk;
+			if (q_pos == quantum) {
+				q_pos = 0;
+				s_pos++;
+			}
+		}
 	}
-	*f_pos += count;
-	retval = count;
-
-  out:
-	up(&dev->sem);
-	return retval;
+	return done;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t scull_do_write(struct scull_dev *dev, const struct iovec *iov,
+                unsigned long nr_segs, loff_t *f_pos)
 {
-	struct scull_dev *dev = filp->private_data;
 	struct scull_qset *dptr;
 	int quantum = dev->quantum, qset = dev->qset;
 	int itemsize = quantum * qset;
 	int item, s_pos, q_pos, rest;
+	loff_t pos = *f_pos;
+	ssize_t done = 0;
 	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
-
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+	unsigned long seg;
 
 	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
+	item = (long)pos / itemsize;
+	rest = (long)pos % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
 	/* follow the list up to the right position */
 	dptr = scull_follow(dev, item);
 	if (dptr == NULL)
 		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		const char __user *buf = iov[seg].iov_base;
+		size_t count = iov[seg].iov_len;
+
+		while (count) {
+			size_t chunk = min(count, (size_t)(quantum - q_pos));
+
+			if (s_pos == qset) { /* move on to the next item */
+				s_pos = 0;
+				dptr = scull_follow_next(dev, dptr);
+				if (dptr == NULL)
+					goto out;
+			}
+			if (!dptr->data) {
+				dptr->data = scull_mag_alloc(SCULL_MAG_QSET,
+						qset * sizeof(char *));
+				if (!dptr->data)
+					goto out;
+				memset(dptr->data, 0, qset * sizeof(char *));
+			}
+			if (!dptr->data[s_pos]) {
+				dptr->data[s_pos] = scull_mag_alloc(SCULL_MAG_QUANTUM,
+						quantum);
+				if (!dptr->data[s_pos])
+					goto out;
+			}
+			if (copy_from_user(dptr->data[s_pos]+q_pos, buf, chunk)) {
+				retval = -EFAULT;
+				goto out;
+			}
+			buf += chunk;
+			count -= chunk;
+			pos += chunk;
+			done += chunk;
+			*f_pos = pos;
+
+			/* update the size */
+			if (dev->size < pos)
+				dev->size = pos;
+
+			/* step to the next quantum if this one is done */
+			q_pos += chunk;
+			if (q_pos == quantum) {
+				q_pos = 0;
+				s_pos++;
+			}
+		}
 	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	return done;
 
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
+  out:
+	return done ? done : retval;
+}
+
+ssize_t scull_readv(struct file *filp, const struct iovec *iov,
+                unsigned long nr_segs, loff_t *f_pos)
+{
+	struct scull_dev *dev = filp->private_data; 
+	ssize_t retval;
+
+	down_read(&dev->sem);
+	retval = scull_do_read(dev, iov, nr_segs, f_pos);
+	up_read(&dev->sem);
+	return retval;
+}
+
+ssize_t scull_writev(struct file *filp, const struct iovec *iov,
+                unsigned long nr_segs, loff_t *f_pos)
+{
+	struct scull_dev *dev = filp->private_data;
+	ssize_t retval;
+
+	down_write(&dev->sem);
+	retval = scull_do_write(dev, iov, nr_segs, f_pos);
+	up_write(&dev->sem);
+	return retval;
+}
+
+ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return scull_readv(filp, &iov, 1, f_pos);
+}
+
+ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	struct iovec iov = { .iov_base = (void __user *) buf, .iov_len = count };
+
+	return scull_writev(filp, &iov, 1, f_pos);
+}
+
+/*
+ * Holes: a device is sparse, as quanta are only allocated when written.
+ * Find the first offset at or after "pos" that is in data (or in a
+ * hole, if "data" is zero), looking at the qset map. Past the end of
+ * the list everything is a hole, and there's an implicit hole at the
+ * end of the device. The caller holds the semaphore for reading.
+ */
+static loff_t scull_find(struct scull_dev *dev, loff_t pos, int data)
+{
+	struct scull_qset *dptr;
+	int quantum = dev->quantum, qset = dev->qset;
+	long itemsize = quantum * qset;
+	long item = (long)pos / itemsize;
+	int s_pos = ((long)pos % itemsize) / quantum;
+	int present;
+
+	dptr = scull_lookup(dev, item);
+	while (pos < dev->size) {
+		present = dptr && dptr->data && dptr->data[s_pos];
+		if (present == data)
+			return pos;
+		if (!dptr) /* the rest is all hole */
+			break;
+		if (!dptr->data) { /* skip the whole item */
+			pos = (item + 1) * itemsize;
+			s_pos = qset;
+		} else {
+			pos = ((long)pos / quantum + 1) * quantum;
+			s_pos++;
+		}
+		if (s_pos == qset) {
+			s_pos = 0;
+			item++;
+			dptr = dptr->next;
+		}
 	}
-	*f_pos += count;
-	retval = count;
+	if (data)
+		return -ENXIO;
+	return min(pos, (loff_t) dev->size);
+}
 
-        /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+/*
+ * Fill the user's extent map with the data extents from map->start on.
+ * The caller holds the semaphore for reading.
+ */
+static int scull_get_extents(struct scull_dev *dev,
+		struct scull_extent_map __user *umap)
+{
+	struct scull_extent_map map;
+	struct scull_extent ext;
+	loff_t pos, hole;
+	int retval = 0;
 
+	if (copy_from_user(&map, umap, sizeof(map)))
+		return -EFAULT;
+	pos = map.start;
+	if (pos < 0)
+		return -EINVAL;
+	map.flags = 0;
+	map.count = 0;
+	if (pos >= dev->size)
+		goto out; /* nothing there: an empty map */
+	for (; map.count < map.room; map.count++) {
+		pos = scull_find(dev, pos, 1);
+		if (pos < 0)
+			break;
+		hole = scull_find(dev, pos, 0);
+		ext.offset = pos;
+		ext.length = hole - pos;
+		if (copy_to_user(umap->extents + map.count, &ext, sizeof(ext)))
+			return -EFAULT;
+		pos = hole;
+	}
+	if (map.count == map.room && pos >= 0 && scull_find(dev, pos, 1) >= 0)
+		map.flags |= SCULL_EXTENT_MORE;
   out:
-	up(&dev->sem);
+	if (copy_to_user(umap, &map, sizeof(map)))
+		retval = -EFAULT;
 	return retval;
 }
 
@@ -396,6 +765,8 @@ int scull_ioctl(struct inode *inode, struct file *filp,
 
 	int err = 0, tmp;
 	int retval = 0;
+	struct scull_dev *dev;
+	loff_t off;
     
 	/*
 	 * extract the type and number bitfields, and don't decode
@@ -494,9 +865,10 @@ int scull_ioctl(struct inode *inode, struct file *filp,
 		return tmp;
 
         /*
-         * The following two change the buffer size for scullpipe.
+         * The following two change the default buffer size for scullpipe.
          * The scullpipe device uses this same ioctl method, just to
-         * write less code. Actually, it's the same driver, isn't it?
+         * write less code, but it resizes itself on these two commands
+         * (see scull_p_ioctl). Actually, it's the same driver, isn't it?
          */
 
 	  case SCULL_P_IOCTSIZE:
@@ -506,6 +878,27 @@ int scull_ioctl(struct inode *inode, struct file *filp,
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	  case SCULL_IOCGEXTENTS: /* arg points to a scull_extent_map */
+		dev = filp->private_data;
+		down_read(&dev->sem);
+		retval = scull_get_extents(dev,
+				(struct scull_extent_map __user *)arg);
+		up_read(&dev->sem);
+		break;
+
+	  case SCULL_IOCXSEEKDATA: /* lseek() can't pass these through */
+	  case SCULL_IOCXSEEKHOLE:
+		/* no 64-bit __get_user on i386: copy it */
+		if (copy_from_user(&off, (void __user *)arg, sizeof(off)))
+			return -EFAULT;
+		off = scull_llseek(filp, off, cmd == SCULL_IOCXSEEKDATA ?
+				SEEK_DATA : SEEK_HOLE);
+		if (off < 0)
+			return off;
+		if (copy_to_user((void __user *)arg, &off, sizeof(off)))
+			return -EFAULT;
+		break;
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -538,6 +931,20 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	  case SEEK_DATA: /* the next data at or after "off" */
+	  case SEEK_HOLE: /* the next hole at or after "off" */
+		if (off < 0)
+			return -EINVAL;
+		down_read(&dev->sem);
+		if (off >= dev->size)
+			newpos = -ENXIO;
+		else
+			newpos = scull_find(dev, off, whence == SEEK_DATA);
+		up_read(&dev->sem);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	  default: /* can't happen */
 		return -EINVAL;
 	}
@@ -553,6 +960,8 @@ struct file_operations scull_fops = {
 	.llseek =   scull_llseek,
 	.read =     scull_read,
 	.write =    scull_write,
+	.readv =    scull_readv,
+	.writev =   scull_writev,
 	.ioctl =    scull_ioctl,
 	.open =     scull_open,
 	.release =  scull_release,
@@ -592,6 +1001,10 @@ void scull_cleanup_module(void)
 	scull_p_cleanup();
 	scull_access_cleanup();
 
+	/* free what the trims above left behind, then the cached quanta */
+	scull_reclaim_drain();
+	scull_mag_cleanup();
+
 }
 
 
@@ -634,6 +1047,11 @@ int scull_init_module(void)
 		return result;
 	}
 
+	/* the quantum cache must be there before any device is used */
+	result = scull_mag_init();
+	if (result)
+		goto fail;
+
         /* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -649,7 +1067,9 @@ int scull_init_module(void)
 	for (i = 0; i < scull_nr_devs; i++) {
 		scull_devices[i].quantum = scull_quantum;
 		scull_devices[i].qset = scull_qset;
-		init_MUTEX(&scull_devices[i].sem);
+		scull_devices[i].radix = scull_radix;
+		INIT_RADIX_TREE(&scull_devices[i].qtree, GFP_KERNEL);
+		init_rwsem(&scull_devices[i].sem);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
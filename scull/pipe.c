@@ -26,16 +26,36 @@
 #include <linux/fcntl.h>
 #include <linux/poll.h>
 #include <linux/cdev.h>
+#include <linux/mm.h>		/* virt_to_page(), page_count() */
+#include <linux/highmem.h>	/* kmap() */
+#include <linux/timer.h>
+#include <linux/jiffies.h>
 #include <asm/uaccess.h>
 
 #include "scull.h"		/* local definitions */
 
+/*
+ * The buffer is managed like a kfifo (see kernel/kfifo.c): its size is
+ * a power of two, and "in" and "out" run freely and are only masked
+ * when used as offsets. in - out is what's queued, and the whole
+ * buffer can be used. With one reader and one writer, the reader only
+ * moves "out" and the writer only moves "in", so no lock is needed.
+ *
+ * The buffer is an array of pages, each allocated by the writer when
+ * it first gets there, so a large but idle pipe costs next to nothing.
+ */
 struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
-        char *buffer, *end;                /* begin of buf, end of buf */
-        int buffersize;                    /* used in pointer arithmetic */
-        char *rp, *wp;                     /* where to read, where to write */
+        char **pages;                      /* the circular buffer */
+        unsigned int buffersize;           /* a power of two */
+        unsigned int resident;             /* how many pages are allocated */
+        unsigned int in, out;              /* where to write, where to read */
         int nreaders, nwriters;            /* number of openings for r/w */
+        int spsc;                          /* single reader/writer, no lock */
+        unsigned int rlowat, wlowat;       /* wake readers/writers at this */
+        unsigned long flush;               /* wake readers anyway after this */
+        struct timer_list flush_timer;     /* ... using this timer */
+        int flush_due;                     /* the timer fired, data is late */
         struct fasync_struct *async_queue; /* asynchronous readers */
         struct semaphore sem;              /* mutual exclusion semaphore */
         struct cdev cdev;                  /* Char device structure */
@@ -44,15 +64,216 @@ struct scull_pipe {
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;	/* buffer size */
+static int scull_p_spsc = 0;		/* lockless single reader/writer */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);	/* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_spsc, int, S_IRUGO | S_IWUSR);
 
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
 static int spacefree(struct scull_pipe *dev);
+
+/* Readers below the watermark get their data anyway after this long */
+#define SCULL_P_FLUSH (HZ/10)
+
+/*
+ * Pipe buffers are rounded up to a power of two, and can't be larger
+ * than this: the page array is allocated with kmalloc.
+ */
+#define SCULL_P_MAXBUF (16 << 20)
+
+static unsigned int scull_p_roundsize(int size)
+{
+	if (size < 2)
+		size = 2;
+	if (size > SCULL_P_MAXBUF)
+		size = SCULL_P_MAXBUF;
+	return roundup_pow_of_two(size);
+}
+
+static inline int scull_p_npages(unsigned int size)
+{
+	return (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+}
+
+/* Allocate the page array of a buffer; the pages come later */
+static char **scull_p_alloc_pages(unsigned int size)
+{
+	char **pages;
+	int n = scull_p_npages(size);
+
+	pages = kmalloc(n * sizeof(char *), GFP_KERNEL);
+	if (pages)
+		memset(pages, 0, n * sizeof(char *));
+	return pages;
+}
+
+static void scull_p_free_pages(char **pages, unsigned int size)
+{
+	int i;
+
+	if (!pages)
+		return;
+	for (i = 0; i < scull_p_npages(size); i++)
+		if (pages[i])
+			free_page((unsigned long) pages[i]);
+	kfree(pages);
+}
+
+/*
+ * Where does ring index "idx" live, and how many bytes can be moved
+ * from there before the end of the page or of the buffer?
+ */
+static inline char **scull_p_where(char **pages, unsigned int size,
+		unsigned int idx, unsigned int *poff, unsigned int *room)
+{
+	unsigned int off = idx & (size - 1);
+
+	*poff = off & ~PAGE_MASK;
+	*room = min((unsigned int) PAGE_SIZE - *poff, size - off);
+	return pages + (off >> PAGE_SHIFT);
+}
+
+/*
+ * Return the page holding ring index "idx", allocating it when the
+ * writer gets there first; the reader only looks at data that was
+ * written, so its pages are always there.
+ */
+static char *scull_p_page(struct scull_pipe *dev, unsigned int idx,
+		unsigned int *poff, unsigned int *room)
+{
+	char **page = scull_p_where(dev->pages, dev->buffersize, idx,
+			poff, room);
+
+	if (!*page) {
+		*page = (char *) __get_free_page(GFP_KERNEL);
+		if (*page)
+			dev->resident++;
+	}
+	return *page;
+}
+
+/*
+ * Copy "len" bytes between user space and the ring, starting at ring
+ * index "idx".
+ */
+static int scull_p_copy(struct scull_pipe *dev, unsigned int idx,
+		char __user *buf, unsigned int len, int write)
+{
+	unsigned int poff, room;
+	char *page;
+
+	while (len) {
+		page = scull_p_page(dev, idx, &poff, &room);
+		if (!page)
+			return -ENOMEM;
+		room = min(room, len);
+		if (write ? copy_from_user(page + poff, buf, room)
+				: copy_to_user(buf, page + poff, room))
+			return -EFAULT;
+		idx += room;
+		buf += room;
+		len -= room;
+	}
+	return 0;
+}
+
+/* The same, from kernel space, for sendpage */
+static int scull_p_copy_kernel(struct scull_pipe *dev, unsigned int idx,
+		const char *buf, unsigned int len)
+{
+	unsigned int poff, room;
+	char *page;
+
+	while (len) {
+		page = scull_p_page(dev, idx, &poff, &room);
+		if (!page)
+			return -ENOMEM;
+		room = min(room, len);
+		memcpy(page + poff, buf, room);
+		idx += room;
+		buf += room;
+		len -= room;
+	}
+	return 0;
+}
+
+/*
+ * In single-producer/single-consumer mode the data path runs without
+ * the semaphore; it is still used by open and release.
+ */
+static inline int scull_p_lock(struct scull_pipe *dev)
+{
+	if (dev->spsc)
+		return 0;
+	return down_interruptible(&dev->sem);
+}
+
+static inline void scull_p_unlock(struct scull_pipe *dev)
+{
+	if (!dev->spsc)
+		up(&dev->sem);
+}
+
+/*
+ * Wake up the other side, but only if somebody is sleeping there. The
+ * barrier orders the update of in or out before the check; a sleeper
+ * queues itself before testing the index, so it can't be missed.
+ */
+static inline void scull_p_wake(wait_queue_head_t *q)
+{
+	smp_mb();
+	if (waitqueue_active(q))
+		wake_up_interruptible(q);
+}
+
+/*
+ * Wakeups are batched with watermarks: readers are only woken once
+ * rlowat bytes are queued, or when the flush timer fires, and writers
+ * once wlowat bytes are free. Both default to 1, which means "always".
+ */
+static inline unsigned int scull_p_rlowat(struct scull_pipe *dev)
+{
+	return min(dev->rlowat, dev->buffersize);
+}
+
+static inline unsigned int scull_p_wlowat(struct scull_pipe *dev)
+{
+	return min(dev->wlowat, dev->buffersize);
+}
+
+/* Called by writers, after new data is in */
+static void scull_p_wake_readers(struct scull_pipe *dev)
+{
+	if (dev->in - dev->out >= scull_p_rlowat(dev)) {
+		scull_p_wake(&dev->inq);  /* blocked in read() and select() */
+		/* and signal asynchronous readers, explained late in chapter 5 */
+		if (dev->async_queue)
+			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	} else if (dev->flush && !timer_pending(&dev->flush_timer))
+		mod_timer(&dev->flush_timer, jiffies + dev->flush);
+}
+
+/* Called by readers, after some space was freed */
+static void scull_p_wake_writers(struct scull_pipe *dev)
+{
+	if (spacefree(dev) >= scull_p_wlowat(dev))
+		scull_p_wake(&dev->outq);
+}
+
+/* Data has been waiting below the watermark for too long: deliver it */
+static void scull_p_flush(unsigned long data)
+{
+	struct scull_pipe *dev = (struct scull_pipe *) data;
+
+	dev->flush_due = 1;
+	wake_up_interruptible(&dev->inq);
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
 /*
  * Open and close
  */
@@ -67,17 +288,25 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
-	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-		if (!dev->buffer) {
+	if (!dev->pages) {
+		/* allocate the buffer, rounding its size to a power of two */
+		dev->buffersize = scull_p_roundsize(scull_p_buffer);
+		dev->pages = scull_p_alloc_pages(dev->buffersize);
+		if (!dev->pages) {
 			up(&dev->sem);
 			return -ENOMEM;
 		}
+		dev->resident = 0;
+		dev->in = dev->out = 0; /* rd and wr from the beginning */
+		dev->spsc = scull_p_spsc;
+	}
+
+	/* the lockless mode only allows one reader and one writer */
+	if (dev->spsc && (((filp->f_mode & FMODE_READ) && dev->nreaders) ||
+			((filp->f_mode & FMODE_WRITE) && dev->nwriters))) {
+		up(&dev->sem);
+		return -EBUSY;
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
@@ -103,8 +332,10 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
 	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
-		dev->buffer = NULL; /* the other fields are not checked on open */
+		del_timer_sync(&dev->flush_timer);
+		dev->flush_due = 0;
+		scull_p_free_pages(dev->pages, dev->buffersize);
+		dev->pages = NULL; /* the other fields are not checked on open */
 	}
 	up(&dev->sem);
 	return 0;
@@ -115,43 +346,58 @@ static int scull_p_release(struct inode *inode, struct file *filp)
  * Data management: read and write
  */
 
-static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/* Wait for data to read; caller must hold device semaphore.  On
+ * error the semaphore will be released before returning. */
+static int scull_getreaddata(struct scull_pipe *dev, struct file *filp)
 {
-	struct scull_pipe *dev = filp->private_data;
-
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-
-	while (dev->rp == dev->wp) { /* nothing to read */
-		up(&dev->sem); /* release the lock */
+	while (dev->in == dev->out) { /* nothing to read */
+		scull_p_unlock(dev); /* release the lock */
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+		if (wait_event_interruptible(dev->inq, (dev->in != dev->out)))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
-		if (down_interruptible(&dev->sem))
+		if (scull_p_lock(dev))
 			return -ERESTARTSYS;
 	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
-		up (&dev->sem);
+	return 0;
+}
+
+static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+	struct scull_pipe *dev = filp->private_data;
+	unsigned int len;
+	int result;
+
+	if (scull_p_lock(dev))
+		return -ERESTARTSYS;
+
+	/* Make sure there's data to read */
+	result = scull_getreaddata(dev, filp);
+	if (result)
+		return result; /* scull_getreaddata called up(&dev->sem) */
+
+	/* ok, data is there, return something, wrapping if needed */
+	len = min(count, (size_t)(dev->in - dev->out));
+	/* threads sharing a file could race in lockless mode: stay in bounds */
+	len = min(len, dev->buffersize);
+	smp_rmb(); /* read "in" before the data it covers */
+	if (scull_p_copy(dev, dev->out, buf, len, 0)) {
+		scull_p_unlock(dev);
 		return -EFAULT;
 	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
-	up (&dev->sem);
+	smp_mb(); /* done with the data before the writer can reuse it */
+	dev->out += len;
+	if (dev->in == dev->out)
+		dev->flush_due = 0;
+	scull_p_unlock(dev);
 
 	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
-	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
-	return count;
+	scull_p_wake_writers(dev);
+	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)len);
+	return len;
 }
 
 /* Wait for space for writing; caller must hold device semaphore.  On
@@ -161,7 +407,7 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 	while (spacefree(dev) == 0) { /* full */
 		DEFINE_WAIT(wait);
 		
-		up(&dev->sem);
+		scull_p_unlock(dev);
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
@@ -171,7 +417,7 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 		finish_wait(&dev->outq, &wait);
 		if (signal_pending(current))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-		if (down_interruptible(&dev->sem))
+		if (scull_p_lock(dev))
 			return -ERESTARTSYS;
 	}
 	return 0;
@@ -180,18 +426,17 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 /* How much space is free? */
 static int spacefree(struct scull_pipe *dev)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	return dev->buffersize - (dev->in - dev->out);
 }
 
 static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
+	unsigned int len;
 	int result;
 
-	if (down_interruptible(&dev->sem))
+	if (scull_p_lock(dev))
 		return -ERESTARTSYS;
 
 	/* Make sure there's space to write */
@@ -199,30 +444,249 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 	if (result)
 		return result; /* scull_getwritespace called up(&dev->sem) */
 
-	/* ok, space is there, accept something */
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-	else /* the write pointer has wrapped, fill up to rp-1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
-		up (&dev->sem);
-		return -EFAULT;
+	/* ok, space is there, accept something, wrapping if needed */
+	len = min(count, (size_t)spacefree(dev));
+	/* threads sharing a file could race in lockless mode: stay in bounds */
+	len = min(len, dev->buffersize);
+	smp_mb(); /* read "out" before overwriting the space it frees */
+	PDEBUG("Going to accept %li bytes at %u from %p\n", (long)len, dev->in, buf);
+	result = scull_p_copy(dev, dev->in, (char __user *) buf, len, 1);
+	if (result) {
+		scull_p_unlock(dev);
+		return result;
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer; /* wrapped */
+	smp_wmb(); /* the data must be there before "in" says so */
+	dev->in += len;
+	scull_p_unlock(dev);
+
+	/* finally, awake any reader, if there's enough to read */
+	scull_p_wake_readers(dev);
+	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)len);
+	return len;
+}
+
+/*
+ * sendfile from a pipe: the ring pages themselves are handed to the
+ * actor, so data goes to a socket with no copy at all. If the target
+ * keeps a reference to a page (the network stack does, until the data
+ * is sent), that page leaves the ring and the writer gets a new one;
+ * whatever was still queued in it is copied over first. Swapping pages
+ * would race with a lockless writer, so that mode is not supported.
+ */
+static ssize_t scull_p_sendfile(struct file *filp, loff_t *ppos,
+		size_t count, read_actor_t actor, void *target)
+{
+	struct scull_pipe *dev = filp->private_data;
+	read_descriptor_t desc;
+	unsigned int poff, room, pend, used;
+	char **page, *spare = NULL;
+	struct page *pg;
+	int result;
+
+	if (dev->spsc)
+		return -EINVAL;
+	if (!count)
+		return 0;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	result = scull_getreaddata(dev, filp);
+	if (result)
+		return result; /* scull_getreaddata called up(&dev->sem) */
+
+	desc.written = 0;
+	desc.count = min(count, (size_t)(dev->in - dev->out));
+	desc.arg.data = target;
+	desc.error = 0;
+	while (desc.count) {
+		/* have a replacement ready before the page can be taken */
+		if (!spare) {
+			spare = (char *) __get_free_page(GFP_KERNEL);
+			if (!spare) {
+				desc.error = -ENOMEM;
+				break;
+			}
+		}
+		page = scull_p_where(dev->pages, dev->buffersize, dev->out,
+				&poff, &room);
+		pend = min(room, dev->in - dev->out);
+		pg = virt_to_page(*page);
+		used = actor(&desc, pg, poff, min(pend, (unsigned int) desc.count));
+		if (page_count(pg) > 1) { /* the target kept it */
+			/*
+			 * Copy unless nothing live is left in the page: not
+			 * after what was sent, nor before "poff", where a
+			 * writer that wrapped all the way round may be.
+			 */
+			if (pend > used || dev->buffersize <= PAGE_SIZE ||
+					dev->in - dev->out > dev->buffersize - poff) {
+				memcpy(spare, *page, PAGE_SIZE);
+				*page = spare;
+				spare = NULL;
+			} else {
+				*page = NULL; /* the writer allocates again */
+				dev->resident--;
+			}
+			put_page(pg); /* drop the ring's own reference */
+		}
+		dev->out += used;
+		if (used < pend)
+			break;
+	}
+	if (dev->in == dev->out)
+		dev->flush_due = 0;
 	up(&dev->sem);
+	if (spare)
+		free_page((unsigned long) spare);
 
-	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	if (desc.written)
+		scull_p_wake_writers(dev);
+	return desc.written ? desc.written : desc.error;
+}
 
-	/* and signal asynchronous readers, explained late in chapter 5 */
-	if (dev->async_queue)
-		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
-	return count;
+/*
+ * sendpage into a pipe, so that sendfile from a regular file only
+ * copies from the page cache into the ring, with no user buffer.
+ */
+static ssize_t scull_p_sendpage(struct file *filp, struct page *page,
+		int offset, size_t size, loff_t *ppos, int more)
+{
+	struct scull_pipe *dev = filp->private_data;
+	unsigned int len;
+	int result;
+
+	if (scull_p_lock(dev))
+		return -ERESTARTSYS;
+	result = scull_getwritespace(dev, filp);
+	if (result)
+		return result; /* scull_getwritespace called up(&dev->sem) */
+
+	len = min(size, (size_t)spacefree(dev));
+	smp_mb(); /* read "out" before overwriting the space it frees */
+	result = scull_p_copy_kernel(dev, dev->in, kmap(page) + offset, len);
+	kunmap(page);
+	if (result) {
+		scull_p_unlock(dev);
+		return result;
+	}
+	smp_wmb(); /* the data must be there before "in" says so */
+	dev->in += len;
+	scull_p_unlock(dev);
+
+	scull_p_wake_readers(dev);
+	return len;
+}
+
+/*
+ * Change the size of a live pipe, keeping what's queued: the data is
+ * moved to the start of a new ring. Called with the semaphore held;
+ * a lockless pipe can only be resized through its only open file
+ * (which counts twice if opened for both), as any other would be
+ * running without the semaphore.
+ */
+static int scull_p_resize(struct scull_pipe *dev, struct file *filp, int size)
+{
+	unsigned int newsize = scull_p_roundsize(size);
+	unsigned int queued = dev->in - dev->out, done = 0;
+	unsigned int spoff, sroom, dpoff, droom, resident = 0;
+	char **pages, **src, **dst;
+	int mine = !!(filp->f_mode & FMODE_READ) + !!(filp->f_mode & FMODE_WRITE);
+
+	if (dev->spsc && dev->nreaders + dev->nwriters > mine)
+		return -EBUSY;
+	if (queued > newsize)
+		return -EBUSY; /* won't throw data away */
+	if (newsize == dev->buffersize)
+		return 0;
+	pages = scull_p_alloc_pages(newsize);
+	if (!pages)
+		return -ENOMEM;
+
+	while (done < queued) {
+		src = scull_p_where(dev->pages, dev->buffersize,
+				dev->out + done, &spoff, &sroom);
+		dst = scull_p_where(pages, newsize, done, &dpoff, &droom);
+		droom = min(min(droom, sroom), queued - done);
+		if (!*dst) {
+			*dst = (char *) __get_free_page(GFP_KERNEL);
+			if (!*dst) {
+				scull_p_free_pages(pages, newsize);
+				return -ENOMEM;
+			}
+			resident++;
+		}
+		memcpy(*dst + dpoff, *src + spoff, droom);
+		done += droom;
+	}
+
+	scull_p_free_pages(dev->pages, dev->buffersize);
+	dev->pages = pages;
+	dev->buffersize = newsize;
+	dev->resident = resident;
+	dev->out = 0;
+	dev->in = queued;
+
+	/* a larger buffer may make room for writers */
+	scull_p_wake_writers(dev);
+	return 0;
+}
+
+/*
+ * On a pipe, the size ioctls act on the pipe itself, which is resized
+ * on the fly; everything else is the same as for the bare device.
+ */
+static int scull_p_ioctl(struct inode *inode, struct file *filp,
+		unsigned int cmd, unsigned long arg)
+{
+	struct scull_pipe *dev = filp->private_data;
+	int retval;
+
+	switch(cmd) {
+
+	  case SCULL_P_IOCTSIZE:
+		if (arg > SCULL_P_MAXBUF)
+			return -EINVAL;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		retval = scull_p_resize(dev, filp, arg);
+		up(&dev->sem);
+		return retval;
+
+	  case SCULL_P_IOCQSIZE:
+		return dev->buffersize;
+
+	  case SCULL_P_IOCTRLOWAT: /* wake readers when this much is queued */
+		if (arg < 1)
+			return -EINVAL;
+		dev->rlowat = arg;
+		return 0;
+
+	  case SCULL_P_IOCQRLOWAT:
+		return dev->rlowat;
+
+	  case SCULL_P_IOCTWLOWAT: /* wake writers when this much is free */
+		if (arg < 1)
+			return -EINVAL;
+		dev->wlowat = arg;
+		return 0;
+
+	  case SCULL_P_IOCQWLOWAT:
+		return dev->wlowat;
+
+	  case SCULL_P_IOCTFLUSH: /* milliseconds; 0 waits for the watermark */
+		dev->flush = msecs_to_jiffies(arg);
+		return 0;
+
+	  case SCULL_P_IOCQFLUSH:
+		return jiffies_to_msecs(dev->flush);
+
+	  case SCULL_IOCGEXTENTS: /* these need a scull_dev, not a pipe */
+	  case SCULL_IOCXSEEKDATA:
+	  case SCULL_IOCXSEEKHOLE:
+		return -ENOTTY;
+
+	  default:
+		return scull_ioctl(inode, filp, cmd, arg);
+	}
 }
 
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
@@ -232,17 +696,21 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 
 	/*
 	 * The buffer is circular; it is considered full
-	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * if "in" is a whole buffer ahead of "out" and empty
+	 * if the two are equal. Like wakeups, readiness
+	 * honours the watermarks, unless data is overdue.
 	 */
-	down(&dev->sem);
+	if (!dev->spsc)
+		down(&dev->sem);
 	poll_wait(filp, &dev->inq,  wait);
 	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
+	if (dev->in - dev->out >= scull_p_rlowat(dev) ||
+			(dev->in != dev->out && dev->flush_due))
 		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
+	if (spacefree(dev) >= scull_p_wlowat(dev))
 		mask |= POLLOUT | POLLWRNORM;	/* writable */
-	up(&dev->sem);
+	if (!dev->spsc)
+		up(&dev->sem);
 	return mask;
 }
 
@@ -291,8 +759,12 @@ static int scull_read_p_mem(char *buf, char **start, off_t offset, int count,
 			return -ERESTARTSYS;
 		len += sprintf(buf+len, "\nDevice %i: %p\n", i, p);
 /*		len += sprintf(buf+len, "   Queues: %p %p\n", p->inq, p->outq);*/
-		len += sprintf(buf+len, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-		len += sprintf(buf+len, "   rp %p   wp %p\n", p->rp, p->wp);
+		len += sprintf(buf+len, "   Buffer: %p (%u bytes, %u pages in use)%s\n",
+				p->pages, p->buffersize, p->resident,
+				p->spsc ? ", lockless" : "");
+		len += sprintf(buf+len, "   in %u   out %u\n", p->in, p->out);
+		len += sprintf(buf+len, "   wake readers at %u, writers at %u, flush %u ms\n",
+				p->rlowat, p->wlowat, jiffies_to_msecs(p->flush));
 		len += sprintf(buf+len, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
 		up(&p->sem);
 		scullp_proc_offset(buf, start, &offset, &len);
@@ -316,7 +788,9 @@ struct file_operations scull_pipe_fops = {
 	.read =		scull_p_read,
 	.write =	scull_p_write,
 	.poll =		scull_p_poll,
-	.ioctl =	scull_ioctl,
+	.ioctl =	scull_p_ioctl,
+	.sendfile =	scull_p_sendfile,
+	.sendpage =	scull_p_sendpage,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -363,6 +837,12 @@ int scull_p_init(dev_t firstdev)
 		init_waitqueue_head(&(scull_p_devices[i].inq));
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		init_MUTEX(&scull_p_devices[i].sem);
+		scull_p_devices[i].rlowat = scull_p_devices[i].wlowat = 1;
+		scull_p_devices[i].flush = SCULL_P_FLUSH;
+		init_timer(&scull_p_devices[i].flush_timer);
+		scull_p_devices[i].flush_timer.function = scull_p_flush;
+		scull_p_devices[i].flush_timer.data =
+			(unsigned long) (scull_p_devices + i);
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 #ifdef SCULL_DEBUG
@@ -388,7 +868,9 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		del_timer_sync(&scull_p_devices[i].flush_timer);
+		scull_p_free_pages(scull_p_devices[i].pages,
+				scull_p_devices[i].buffersize);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
@@ -19,6 +19,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/types.h> /* __u32 and __u64, for the extent map */
 
 /*
  * Macros to help debugging
@@ -48,6 +49,11 @@
 #define SCULL_NR_DEVS 4    /* scull0 through scull3 */
 #endif
 
+#ifndef SEEK_DATA
+#define SEEK_DATA 3	/* not known to this kernel */
+#define SEEK_HOLE 4
+#endif
+
 #ifndef SCULL_P_NR_DEVS
 #define SCULL_P_NR_DEVS 4  /* scullpipe0 through scullpipe3 */
 #endif
@@ -69,6 +75,34 @@
 #define SCULL_QSET    1000
 #endif
 
+/*
+ * The qset list can be indexed through a radix tree, so that finding
+ * the item at a given offset doesn't need to walk the list. Off by default.
+ */
+#ifndef SCULL_RADIX
+#define SCULL_RADIX 0
+#endif
+
+/*
+ * Truncated devices are freed in the background, this many items
+ * at a time, with a tick of rest in between.
+ */
+#ifndef SCULL_RECLAIM_BATCH
+#define SCULL_RECLAIM_BATCH 16
+#endif
+
+/*
+ * Freed quanta and qset arrays are cached per CPU, in "magazines" of a
+ * few objects; this many full magazines are kept in the shared depot.
+ */
+#ifndef SCULL_MAG_DEPOT
+#define SCULL_MAG_DEPOT 64
+#endif
+
+#define SCULL_MAG_QUANTUM 0	/* the two classes of cached objects */
+#define SCULL_MAG_QSET    1
+#define SCULL_MAG_CLASSES 2
+
 /*
  * The pipe device is a simple circular buffer. Here its default size
  */
@@ -86,11 +120,14 @@ struct scull_qset {
 
 struct scull_dev {
 	struct scull_qset *data;  /* Pointer to first quantum set */
+	struct radix_tree_root qtree; /* index of the qsets, if "radix" */
+	unsigned long nqsets;     /* how many qsets are in the list */
+	int radix;                /* look qsets up through qtree */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct semaphore sem;     /* mutual exclusion semaphore     */
+	struct rw_semaphore sem;  /* readers share, writers exclude */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -108,6 +145,7 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_radix;
 
 extern int scull_p_buffer;	/* pipe.c */
 
@@ -123,10 +161,22 @@ void    scull_access_cleanup(void);
 
 int     scull_trim(struct scull_dev *dev);
 
+int     scull_mag_init(void);	/* magazine.c */
+void    scull_mag_cleanup(void);
+void   *scull_mag_alloc(int class, size_t size);
+void    scull_mag_free(int class, void *obj, size_t size);
+void    scull_mag_free_bulk(int class, void **objs, int n, size_t size);
+struct seq_file;
+void    scull_mag_seq_show(struct seq_file *s);
+
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                     loff_t *f_pos);
+ssize_t scull_readv(struct file *filp, const struct iovec *iov,
+                    unsigned long nr_segs, loff_t *f_pos);
+ssize_t scull_writev(struct file *filp, const struct iovec *iov,
+                     unsigned long nr_segs, loff_t *f_pos);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 int     scull_ioctl(struct inode *inode, struct file *filp,
                     unsigned int cmd, unsigned long arg);
@@ -170,8 +220,47 @@ int     scull_ioctl(struct inode *inode, struct file *filp,
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * Wakeup watermarks for scullpipe, in bytes; the flush deadline for
+ * data below the read watermark is in milliseconds.
+ */
+#define SCULL_P_IOCTRLOWAT _IO(SCULL_IOC_MAGIC, 15)
+#define SCULL_P_IOCQRLOWAT _IO(SCULL_IOC_MAGIC, 16)
+#define SCULL_P_IOCTWLOWAT _IO(SCULL_IOC_MAGIC, 17)
+#define SCULL_P_IOCQWLOWAT _IO(SCULL_IOC_MAGIC, 18)
+#define SCULL_P_IOCTFLUSH  _IO(SCULL_IOC_MAGIC, 19)
+#define SCULL_P_IOCQFLUSH  _IO(SCULL_IOC_MAGIC, 20)
+/*
+ * Devices are sparse. These two work like lseek() with SEEK_DATA and
+ * SEEK_HOLE, which scull_llseek knows but sys_lseek doesn't pass on:
+ * arg points to the starting offset, and gets the result.
+ */
+#define SCULL_IOCXSEEKDATA _IOWR(SCULL_IOC_MAGIC, 21, loff_t)
+#define SCULL_IOCXSEEKHOLE _IOWR(SCULL_IOC_MAGIC, 22, loff_t)
+
+/*
+ * The map of the data extents from "start" on, in one call. The caller
+ * provides room for "room" extents after the header; "count" tells how
+ * many were filled, and SCULL_EXTENT_MORE if some more didn't fit.
+ */
+struct scull_extent {
+	__u64 offset;
+	__u64 length;
+};
+
+struct scull_extent_map {
+	__u64 start;
+	__u32 room;
+	__u32 count;
+	__u32 flags;
+	struct scull_extent extents[0];
+};
+#define SCULL_EXTENT_MORE 1
+
+#define SCULL_IOCGEXTENTS _IOWR(SCULL_IOC_MAGIC, 23, struct scull_extent_map)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 23
 
 #endif /* _SCULL_H_ */
@@ -27,6 +27,11 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
+#include <linux/mm.h>		/* get_user_pages() */
+#include <linux/sched.h>	/* mmput() */
+#include <linux/highmem.h>	/* kmap() */
+#include <linux/kthread.h>
+#include <linux/wait.h>
 #include <asm/uaccess.h>
 #include "scullc.h"		/* local definitions */
 
@@ -40,6 +45,9 @@ module_param(scullc_major, int, 0);
 module_param(scullc_devs, int, 0);
 module_param(scullc_qset, int, 0);
 module_param(scullc_quantum, int, 0);
+
+static int scullc_aio_threads = 0;	/* 0: one per online CPU */
+module_param(scullc_aio_threads, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -48,8 +56,105 @@ struct scullc_dev *scullc_devices; /* allocated in scullc_init */
 int scullc_trim(struct scullc_dev *dev);
 void scullc_cleanup(void);
 
-/* declare one cache pointer: use it for all devices */
-kmem_cache_t *scullc_cache;
+/*
+ * One slab cache per quantum size in use, shared by all the devices
+ * with that quantum: a device takes a reference when it allocates its
+ * first quantum, and drops it at trim time. The slab allocator keeps
+ * freed objects around for reuse; a shrinker has it give them back
+ * when memory gets short.
+ */
+struct scullc_cache {
+	struct list_head list;
+	int size;			/* the quantum */
+	int users;			/* devices holding a reference */
+	kmem_cache_t *cache;
+	char name[20];			/* the slab keeps a pointer to it */
+	atomic_t allocs, frees;		/* over the life of the cache */
+	atomic_t freed;			/* since the last shrink */
+};
+
+static LIST_HEAD(scullc_caches);
+static DECLARE_MUTEX(scullc_caches_sem);	/* protects the list */
+static struct shrinker *scullc_shrinker;
+
+static struct scullc_cache *scullc_get_cache(int size)
+{
+	struct scullc_cache *c;
+
+	down(&scullc_caches_sem);
+	list_for_each_entry(c, &scullc_caches, list)
+		if (c->size == size)
+			goto found;
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		goto out;
+	memset(c, 0, sizeof(*c));
+	c->size = size;
+	sprintf(c->name, "scullc-%i", size);
+	c->cache = kmem_cache_create(c->name, size,
+			0, SLAB_HWCACHE_ALIGN, NULL, NULL); /* no ctor/dtor */
+	if (!c->cache) {
+		kfree(c);
+		c = NULL;
+		goto out;
+	}
+	list_add(&c->list, &scullc_caches);
+  found:
+	c->users++;
+  out:
+	up(&scullc_caches_sem);
+	return c;
+}
+
+static void scullc_put_cache(struct scullc_cache *c)
+{
+	down(&scullc_caches_sem);
+	if (--c->users == 0) {
+		list_del(&c->list);
+		kmem_cache_destroy(c->cache);
+		kfree(c);
+	}
+	up(&scullc_caches_sem);
+}
+
+/*
+ * The shrinker. How many objects sit free in the caches is the slab's
+ * business, so what we report is how many were freed since the last
+ * shrink: those the slab may still hold though nobody uses them.
+ *
+ * shrink_slab asks for that count once per round, then calls again
+ * once per SHRINK_BATCH to scan. kmem_cache_shrink drains every CPU's
+ * array with an IPI, so it is done only on the first scan call of a
+ * round, and only for the caches that had something freed; the other
+ * calls are no-ops.
+ */
+static unsigned long scullc_shrink_round;	/* bit 0: not shrunk yet */
+
+static int scullc_shrink(int nr_to_scan, unsigned int gfp_mask)
+{
+	struct scullc_cache *c;
+	int freed = 0;
+
+	if (nr_to_scan && !test_and_clear_bit(0, &scullc_shrink_round))
+		return 0; /* done this round */
+	if (down_trylock(&scullc_caches_sem)) { /* maybe it's us allocating */
+		if (!nr_to_scan)
+			return 0;
+		set_bit(0, &scullc_shrink_round); /* try next time */
+		return -1;
+	}
+	list_for_each_entry(c, &scullc_caches, list) {
+		if (nr_to_scan && atomic_read(&c->freed)) {
+			kmem_cache_shrink(c->cache);
+			atomic_set(&c->freed, 0);
+		}
+		freed += atomic_read(&c->freed);
+	}
+	up(&scullc_caches_sem);
+	if (!nr_to_scan && freed)
+		set_bit(0, &scullc_shrink_round);
+	return freed;
+}
 
 
 
@@ -79,9 +184,10 @@ void scullc_proc_offset(char *buf, char **start, off_t *offset, int *len)
 int scullc_read_procmem(char *buf, char **start, off_t offset,
                    int count, int *eof, void *data)
 {
-	int i, j, quantum, qset, len = 0;
-	int limit = count - 80; /* Don't print more than this */
+	int i, j, quantum, qset, size, inuse, len = 0;
+	int limit = count - 160; /* Don't print more than this */
 	struct scullc_dev *d;
+	struct scullc_cache *c;
 
 	*start = buf;
 	for(i = 0; i < scullc_devs; i++) {
@@ -108,9 +214,28 @@ int scullc_read_procmem(char *buf, char **start, off_t offset,
 		}
 	  out:
 		up (&scullc_devices[i].sem);
+		if (len > limit)
+			return len;
+	}
+
+	/* The caches: how much of each object is quantum, how many in use */
+	if (down_interruptible(&scullc_caches_sem))
+		return -ERESTARTSYS;
+	list_for_each_entry(c, &scullc_caches, list) {
+		size = kmem_cache_size(c->cache);
+		inuse = atomic_read(&c->allocs) - atomic_read(&c->frees);
+		len += sprintf(buf+len, "\nCache %s: object %i bytes, %i%% used,"
+				" %i devices\n  %i in use (%li KB), %i allocs, "
+				"%i frees, %i freed since last shrink\n",
+				c->name, size, c->size * 100 / size, c->users,
+				inuse, (long) inuse * size >> 10,
+				atomic_read(&c->allocs), atomic_read(&c->frees),
+				atomic_read(&c->freed));
+		scullc_proc_offset (buf, start, &offset, &len);
 		if (len > limit)
 			break;
 	}
+	up(&scullc_caches_sem);
 	*eof = 1;
 	return len;
 }
@@ -242,12 +367,16 @@ ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
 			goto nomem;
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
-	/* Allocate a quantum using the memory cache */
+	/* Allocate a quantum using the memory cache for its size */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
+		if (!dev->cache && !(dev->cache = scullc_get_cache(quantum)))
+			goto nomem;
+		dptr->data[s_pos] = kmem_cache_alloc(dev->cache->cache,
+				GFP_KERNEL);
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, scullc_quantum);
+		atomic_inc(&dev->cache->allocs);
+		memset(dptr->data[s_pos], 0, quantum);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -395,50 +524,187 @@ loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 
 
 /*
- * A simple asynchronous I/O implementation.
+ * Asynchronous I/O. io_submit only queues the request; the copy is done
+ * later by one of a pool of kernel threads. They have no user context
+ * of their own, so they reach the buffer through the submitter's mm:
+ * each page is pinned with get_user_pages and the usual read and write
+ * methods are run on its kernel address, with the address limit
+ * raised. A thread takes up to SCULLC_AIO_BATCH requests at a time and
+ * completes them together, one io context after the other.
  */
+#define SCULLC_AIO_BATCH 16
 
-struct async_work {
+struct scullc_aio {
+	struct list_head list;
 	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
+	struct mm_struct *mm;	/* the submitter's, with a reference */
+	char __user *buf;
+	size_t count;
+	loff_t pos;
+	int write;
+	ssize_t result;
 };
 
+static LIST_HEAD(scullc_aio_queue);
+static spinlock_t scullc_aio_lock = SPIN_LOCK_UNLOCKED;
+static DECLARE_WAIT_QUEUE_HEAD(scullc_aio_wait);
+static struct task_struct **scullc_aio_tasks;
+static int scullc_aio_ntasks;
+
 /*
- * "Complete" an asynchronous operation.
+ * Do the copy for a request, a page of the user buffer at a time.
  */
-static void scullc_do_deferred_op(void *p)
+static ssize_t scullc_aio_rw(struct scullc_aio *req)
 {
-	struct async_work *stuff = (struct async_work *) p;
-	aio_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
+	struct file *filp = req->iocb->ki_filp;
+	unsigned long addr = (unsigned long) req->buf;
+	size_t done = 0, off, len, n;
+	ssize_t ret = 0;
+	struct page *page;
+	mm_segment_t oldfs = get_fs();
+	char *kaddr;
+
+	set_fs(KERNEL_DS);
+	while (done < req->count) {
+		off = (addr + done) & ~PAGE_MASK;
+		len = min_t(size_t, PAGE_SIZE - off, req->count - done);
+		down_read(&req->mm->mmap_sem);
+		ret = get_user_pages(current, req->mm, addr + done, 1,
+				!req->write, 0, &page, NULL);
+		up_read(&req->mm->mmap_sem);
+		if (ret < 1) {
+			ret = -EFAULT;
+			break;
+		}
+		/* read and write stop at the end of a quantum: loop */
+		kaddr = (char *) kmap(page) + off;
+		for (n = 0; n < len; n += ret) {
+			if (req->write)
+				ret = scullc_write(filp, (char __user *) kaddr + n,
+						len - n, &req->pos);
+			else
+				ret = scullc_read(filp, (char __user *) kaddr + n,
+						len - n, &req->pos);
+			if (ret <= 0)
+				break;
+		}
+		kunmap(page);
+		if (!req->write)
+			set_page_dirty_lock(page);
+		put_page(page);
+		done += n;
+		if (ret <= 0)
+			break; /* error, or end of data */
+	}
+	set_fs(oldfs);
+	return done ? done : ret;
 }
 
+static int scullc_aio_thread(void *unused)
+{
+	struct scullc_aio *batch[SCULLC_AIO_BATCH];
+	struct mm_struct *mm[SCULLC_AIO_BATCH];
+	struct kioctx *ctx;
+	int i, j, n;
+	DEFINE_WAIT(wait);
+
+	while (!kthread_should_stop()) {
+		/* Exclusive: one request shouldn't wake the whole pool */
+		prepare_to_wait_exclusive(&scullc_aio_wait, &wait,
+				TASK_INTERRUPTIBLE);
+		if (list_empty(&scullc_aio_queue) && !kthread_should_stop())
+			schedule();
+		finish_wait(&scullc_aio_wait, &wait);
+
+		spin_lock(&scullc_aio_lock);
+		for (n = 0; n < SCULLC_AIO_BATCH &&
+				!list_empty(&scullc_aio_queue); n++) {
+			batch[n] = list_entry(scullc_aio_queue.next,
+					struct scullc_aio, list);
+			list_del(&batch[n]->list);
+		}
+		if (!list_empty(&scullc_aio_queue))
+			wake_up(&scullc_aio_wait); /* more for somebody else */
+		spin_unlock(&scullc_aio_lock);
 
-static int scullc_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
+		for (i = 0; i < n; i++) {
+			batch[i]->result = scullc_aio_rw(batch[i]);
+			mm[i] = batch[i]->mm;
+		}
+		/* Complete them, grouped by io context */
+		for (i = 0; i < n; i++) {
+			if (!batch[i])
+				continue;
+			ctx = batch[i]->iocb->ki_ctx;
+			for (j = i; j < n; j++) {
+				if (!batch[j] || batch[j]->iocb->ki_ctx != ctx)
+					continue;
+				aio_complete(batch[j]->iocb, batch[j]->result, 0);
+				kfree(batch[j]);
+				batch[j] = NULL;
+			}
+		}
+		/*
+		 * Only now let the address spaces go: the last mmput runs
+		 * exit_aio, which waits for these very requests to complete.
+		 */
+		for (i = 0; i < n; i++)
+			mmput(mm[i]);
+	}
+	return 0;
+}
+
+static int scullc_aio_start(void)
 {
-	struct async_work *stuff;
-	int result;
+	struct task_struct *task;
+	int i, n = scullc_aio_threads > 0 ? scullc_aio_threads : num_online_cpus();
 
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = scullc_write(iocb->ki_filp, buf, count, &pos);
-	else
-		result = scullc_read(iocb->ki_filp, buf, count, &pos);
+	scullc_aio_tasks = kmalloc(n * sizeof(struct task_struct *), GFP_KERNEL);
+	if (!scullc_aio_tasks)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		task = kthread_run(scullc_aio_thread, NULL, "scullc_aio/%i", i);
+		if (IS_ERR(task))
+			break; /* make do with fewer */
+		scullc_aio_tasks[scullc_aio_ntasks++] = task;
+	}
+	return scullc_aio_ntasks ? 0 : -ENOMEM;
+}
+
+static void scullc_aio_stop(void)
+{
+	while (scullc_aio_ntasks)
+		kthread_stop(scullc_aio_tasks[--scullc_aio_ntasks]);
+	kfree(scullc_aio_tasks);
+	scullc_aio_tasks = NULL;
+}
 
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
 
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_WORK(&stuff->work, scullc_do_deferred_op, stuff);
-	schedule_delayed_work(&stuff->work, HZ/100);
+static int scullc_defer_op(int write, struct kiocb *iocb, char __user *buf,
+		size_t count, loff_t pos)
+{
+	struct scullc_aio *req = NULL;
+
+	/* Synchronous IOCBs are done now, as is everything without memory */
+	if (!is_sync_kiocb(iocb))
+		req = kmalloc (sizeof (*req), GFP_KERNEL);
+	if (req == NULL) {
+		if (write)
+			return scullc_write(iocb->ki_filp, buf, count, &pos);
+		return scullc_read(iocb->ki_filp, buf, count, &pos);
+	}
+
+	req->iocb = iocb;
+	req->mm = current->mm;
+	atomic_inc(&req->mm->mm_users); /* mmput by the thread */
+	req->buf = buf;
+	req->count = count;
+	req->pos = pos;
+	req->write = write;
+	spin_lock(&scullc_aio_lock);
+	list_add_tail(&req->list, &scullc_aio_queue);
+	spin_unlock(&scullc_aio_lock);
+	wake_up(&scullc_aio_wait);
 	return -EIOCBQUEUED;
 }
 
@@ -486,8 +752,12 @@ int scullc_trim(struct scullc_dev *dev)
 	for (dptr = dev; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
 			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					kmem_cache_free(scullc_cache, dptr->data[i]);
+				if (dptr->data[i]) {
+					kmem_cache_free(dev->cache->cache,
+							dptr->data[i]);
+					atomic_inc(&dev->cache->frees);
+					atomic_inc(&dev->cache->freed);
+				}
 
 			kfree(dptr->data);
 			dptr->data=NULL;
@@ -495,6 +765,9 @@ int scullc_trim(struct scullc_dev *dev)
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	if (dev->cache)
+		scullc_put_cache(dev->cache);
+	dev->cache = NULL;
 	dev->size = 0;
 	dev->qset = scullc_qset;
 	dev->quantum = scullc_quantum;
@@ -557,9 +830,8 @@ int scullc_init(void)
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
 
-	scullc_cache = kmem_cache_create("scullc", scullc_quantum,
-			0, SLAB_HWCACHE_ALIGN, NULL, NULL); /* no ctor/dtor */
-	if (!scullc_cache) {
+	scullc_shrinker = set_shrinker(DEFAULT_SEEKS, scullc_shrink);
+	if (!scullc_shrinker || scullc_aio_start()) {
 		scullc_cleanup();
 		return -ENOMEM;
 	}
@@ -590,8 +862,9 @@ void scullc_cleanup(void)
 	}
 	kfree(scullc_devices);
 
-	if (scullc_cache)
-		kmem_cache_destroy(scullc_cache);
+	scullc_aio_stop();
+	if (scullc_shrinker)
+		remove_shrinker(scullc_shrinker);
 	unregister_chrdev_region(MKDEV (scullc_major, 0), scullc_devs);
 }
 
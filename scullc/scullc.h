@@ -52,11 +52,14 @@
 #define SCULLC_QUANTUM  4000 /* use a quantum size like scull */
 #define SCULLC_QSET     500
 
+struct scullc_cache;
+
 struct scullc_dev {
 	void **data;
 	struct scullc_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
 	int quantum;              /* the current allocation size */
+	struct scullc_cache *cache; /* the slab cache for this quantum */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
 	struct semaphore sem;     /* Mutual exclusion */
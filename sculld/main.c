@@ -21,6 +21,8 @@
 #include <linux/init.h>
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>
+#include <linux/mmzone.h>	/* page_to_nid() */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
@@ -35,11 +37,13 @@ int sculld_major =   SCULLD_MAJOR;
 int sculld_devs =    SCULLD_DEVS;	/* number of bare sculld devices */
 int sculld_qset =    SCULLD_QSET;
 int sculld_order =   SCULLD_ORDER;
+int sculld_interleave = 0;	/* MB; past this, spread pages on all nodes */
 
 module_param(sculld_major, int, 0);
 module_param(sculld_devs, int, 0);
 module_param(sculld_qset, int, 0);
 module_param(sculld_order, int, 0);
+module_param(sculld_interleave, int, S_IRUGO | S_IWUSR);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -97,8 +101,9 @@ int sculld_read_procmem(char *buf, char **start, off_t offset,
 			return -ERESTARTSYS;
 		qset = d->qset;  /* retrieve the features of each device */
 		order = d->order;
-		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
+		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li, "
+				"node %i\n", i, qset, order, (long)(d->size),
+				d->ldev.node);
 		for (; d; d = d->next) { /* scan the list */
 			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
 			sculld_proc_offset (buf, start, &offset, &len);
@@ -170,6 +175,36 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Allocate a quantum where the device wants it. Its node attribute on
+ * the ldd bus names the node; -1 leaves it to the allocator, which
+ * picks the node of the writing process. A device that grows past
+ * sculld_interleave megabytes has the rest of its quanta spread over
+ * all the nodes in turn, so that no single node carries the whole
+ * device and all its readers. Either way, the allocator falls back
+ * to other nodes if the chosen one is out of memory.
+ */
+static void *sculld_alloc_quantum(struct sculld_dev *dev, loff_t pos,
+		int order)
+{
+	struct page *page;
+	int i, nid = dev->ldev.node;
+
+	if (sculld_interleave > 0 && pos >= ((loff_t) sculld_interleave << 20)) {
+		nid = dev->ilv_node;
+		for (i = 0; i < MAX_NUMNODES; i++) {
+			nid = (nid + 1) % MAX_NUMNODES;
+			if (ldd_node_has_memory(nid))
+				break;
+		}
+		dev->ilv_node = nid;
+	}
+	if (nid < 0)
+		return (void *) __get_free_pages(GFP_KERNEL, order);
+	page = alloc_pages_node(nid, GFP_KERNEL, order);
+	return page ? page_address(page) : NULL;
+}
+
 /*
  * Data management: read and write
  */
@@ -251,8 +286,8 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
+		dptr->data[s_pos] = sculld_alloc_quantum(dev, *f_pos,
+				dptr->order);
 		if (!dptr->data[s_pos])
 			goto nomem;
 		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
@@ -541,14 +576,51 @@ static ssize_t sculld_show_dev(struct device *ddev, char *buf)
 
 static DEVICE_ATTR(dev, S_IRUGO, sculld_show_dev, NULL);
 
+/*
+ * Where the pages actually are: one line per node.
+ */
+static ssize_t sculld_show_node_pages(struct device *ddev, char *buf)
+{
+	struct sculld_dev *dptr, *dev = ddev->driver_data;
+	unsigned long *pages;
+	int i, nid, len = 0;
+
+	pages = kmalloc(MAX_NUMNODES * sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	memset(pages, 0, MAX_NUMNODES * sizeof(*pages));
+	if (down_interruptible(&dev->sem)) {
+		kfree(pages);
+		return -ERESTARTSYS;
+	}
+	for (dptr = dev; dptr; dptr = dptr->next) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < dev->qset; i++)
+			if (dptr->data[i])
+				pages[page_to_nid(virt_to_page(dptr->data[i]))] +=
+					1 << dptr->order;
+	}
+	up(&dev->sem);
+	for (nid = 0; nid < MAX_NUMNODES; nid++)
+		if (pages[nid] || ldd_node_has_memory(nid))
+			len += sprintf(buf + len, "node%i %lu\n", nid, pages[nid]);
+	kfree(pages);
+	return len;
+}
+
+static DEVICE_ATTR(node_pages, S_IRUGO, sculld_show_node_pages, NULL);
+
 static void sculld_register_dev(struct sculld_dev *dev, int index)
 {
 	sprintf(dev->devname, "sculld%d", index);
 	dev->ldev.name = dev->devname;
 	dev->ldev.driver = &sculld_driver;
+	dev->ldev.node = -1;	/* no affinity until told otherwise */
 	dev->ldev.dev.driver_data = dev;
 	register_ldd_device(&dev->ldev);
 	device_create_file(&dev->ldev.dev, &dev_attr_dev);
+	device_create_file(&dev->ldev.dev, &dev_attr_node_pages);
 }
 
 
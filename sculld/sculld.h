@@ -59,6 +59,7 @@ struct sculld_dev {
 	struct sculld_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
+	int ilv_node;             /* last node we interleaved to */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
 	struct semaphore sem;     /* Mutual exclusion */
@@ -78,6 +79,7 @@ extern int sculld_major;     /* main.c */
 extern int sculld_devs;
 extern int sculld_order;
 extern int sculld_qset;
+extern int sculld_interleave;
 
 /*
  * Prototypes for shared functions
@@ -24,6 +24,7 @@
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
+#include <linux/mm.h>		/* virt_to_page() */
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/aio.h>
@@ -161,6 +162,36 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Quanta are allocated as a block of 2^order pages, but each page is
+ * given a count of its own, so that they can be mapped one by one (see
+ * mmap.c). They are freed one by one as well: a page somebody else
+ * still holds (through get_user_pages, say) outlives the device data.
+ */
+static void *scullp_alloc_quantum(int order)
+{
+	unsigned long addr = __get_free_pages(GFP_KERNEL, order);
+	struct page *page;
+	int i;
+
+	if (!addr)
+		return NULL;
+	page = virt_to_page(addr);
+	for (i = 1; i < (1 << order); i++)
+		set_page_count(page + i, 1);
+	memset((void *)addr, 0, PAGE_SIZE << order);
+	return (void *)addr;
+}
+
+static void scullp_free_quantum(void *addr, int order)
+{
+	struct page *page = virt_to_page(addr);
+	int i;
+
+	for (i = 0; i < (1 << order); i++)
+		__free_page(page + i);
+}
+
 /*
  * Data management: read and write
  */
@@ -242,11 +273,9 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
+		dptr->data[s_pos] = scullp_alloc_quantum(dptr->order);
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -493,7 +522,7 @@ int scullp_trim(struct scullp_dev *dev)
 			/* This code frees a whole quantum-set */
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
+					scullp_free_quantum(dptr->data[i],
 							dptr->order);
 
 			kfree(dptr->data);
@@ -506,6 +535,7 @@ int scullp_trim(struct scullp_dev *dev)
 	dev->qset = scullp_qset;
 	dev->order = scullp_order;
 	dev->next = NULL;
+	dev->cursor = NULL;
 	return 0;
 }
 
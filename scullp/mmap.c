@@ -20,6 +20,8 @@
 
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
+#include <linux/pagemap.h>	/* linear_page_index() */
+#include <linux/sched.h>	/* current */
 #include <asm/pgtable.h>
 
 #include "scullp.h"		/* local definitions */
@@ -44,44 +46,65 @@ void scullp_vma_close(struct vm_area_struct *vma)
 	dev->vmas--;
 }
 
+/*
+ * Find list item "item" for the fault handler. Sequential faults would
+ * walk the list from its head every time, so the last item found is
+ * remembered; scullp_trim forgets it. The semaphore is held.
+ */
+static struct scullp_dev *scullp_fault_item(struct scullp_dev *dev, int item)
+{
+	struct scullp_dev *ptr = dev;
+	int n = 0;
+
+	if (dev->cursor && dev->cursor_item <= item) {
+		ptr = dev->cursor;
+		n = dev->cursor_item;
+	}
+	for (; ptr && n < item; n++)
+		ptr = ptr->next;
+	if (ptr) {
+		dev->cursor = ptr;
+		dev->cursor_item = item;
+	}
+	return ptr;
+}
+
 /*
  * The nopage method: the core of the file. It retrieves the
  * page required from the scullp device and returns it to the
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * With a nonzero "order", a quantum is a block of several pages. That
+ * works because scullp_alloc_quantum gives each page of the block its
+ * own count: unmapping one decrements that page's count only.
  */
 
 struct page *scullp_vma_nopage(struct vm_area_struct *vma,
                                 unsigned long address, int *type)
 {
-	unsigned long offset;
+	unsigned long pgoff;
 	struct scullp_dev *ptr, *dev = vma->vm_private_data;
 	struct page *page = NOPAGE_SIGBUS;
 	void *pageptr = NULL; /* default to "missing" */
+	int qpages, rest;
 
 	down(&dev->sem);
-	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
+	pgoff = ((address - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	if (pgoff >= (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		goto out; /* out of range */
 
 	/*
 	 * Now retrieve the scullp device from the list,then the page.
 	 * If the device has holes, the process receives a SIGBUS when
 	 * accessing the hole.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
-	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
+	qpages = 1 << dev->order; /* pages in a quantum */
+	ptr = scullp_fault_item(dev, pgoff / (dev->qset * qpages));
+	rest = pgoff % (dev->qset * qpages);
+	if (ptr && ptr->data) pageptr = ptr->data[rest / qpages];
 	if (!pageptr) goto out; /* hole or end-of-file */
-	page = virt_to_page(pageptr);
+	page = virt_to_page(pageptr) + rest % qpages;
 
 	/* got it, now increment the count */
 	get_page(page);
@@ -92,23 +115,44 @@ struct page *scullp_vma_nopage(struct vm_area_struct *vma,
 	return page;
 }
 
+/*
+ * The populate method, for MAP_POPULATE and remap_file_pages(), which
+ * only call it for shared mappings. A module can't set up page tables
+ * for ordinary, counted pages by itself (remap_pfn_range leaves out
+ * all but reserved pages), so the range is faulted in from here with
+ * get_user_pages. Each page still goes through nopage, but there's no
+ * trip to user space and back for it. With "nonblock" (MAP_NONBLOCK)
+ * nothing is faulted in: that would mean waiting for the device
+ * semaphore. mmap_sem is held.
+ */
+static int scullp_vma_populate(struct vm_area_struct *vma,
+		unsigned long addr, unsigned long len, pgprot_t prot,
+		unsigned long pgoff, int nonblock)
+{
+	int ret;
+
+	/* nopage only knows about linear mappings */
+	if (pgoff != linear_page_index(vma, addr))
+		return -EINVAL;
+	if (nonblock)
+		return 0;
+	ret = get_user_pages(current, vma->vm_mm, addr, len >> PAGE_SHIFT,
+			0, 0, NULL, NULL);
+	return ret < 0 ? ret : 0;
+}
+
 
 
 struct vm_operations_struct scullp_vm_ops = {
 	.open =     scullp_vma_open,
 	.close =    scullp_vma_close,
 	.nopage =   scullp_vma_nopage,
+	.populate = scullp_vma_populate,
 };
 
 
 int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_dentry->d_inode;
-
-	/* refuse to map if order is not 0 */
-	if (scullp_devices[iminor(inode)].order)
-		return -ENODEV;
-
 	/* don't do anything here: "nopage" will set up page table entries */
 	vma->vm_ops = &scullp_vm_ops;
 	vma->vm_flags |= VM_RESERVED;
@@ -56,6 +56,8 @@ struct scullp_dev {
 	void **data;
 	struct scullp_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
+	struct scullp_dev *cursor; /* last item found by nopage */
+	int cursor_item;          /* and its number in the list */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
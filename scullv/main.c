@@ -36,11 +36,13 @@ int scullv_major =   SCULLV_MAJOR;
 int scullv_devs =    SCULLV_DEVS;	/* number of bare scullv devices */
 int scullv_qset =    SCULLV_QSET;
 int scullv_order =   SCULLV_ORDER;
+int scullv_fault_around = SCULLV_FAULT_AROUND; /* pages, 0 is off */
 
 module_param(scullv_major, int, 0);
 module_param(scullv_devs, int, 0);
 module_param(scullv_qset, int, 0);
 module_param(scullv_order, int, 0);
+module_param(scullv_fault_around, int, S_IRUGO | S_IWUSR);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -355,6 +357,16 @@ int scullv_ioctl (struct inode *inode, struct file *filp,
 		scullv_qset = arg;
 		return tmp;
 
+	/* The advice is per device, and needs no privilege */
+	case SCULLV_IOCTADVICE:
+		if (arg > SCULLV_ADV_SEQUENTIAL)
+			return -EINVAL;
+		((struct scullv_dev *) filp->private_data)->advice = arg;
+		break;
+
+	case SCULLV_IOCQADVICE:
+		return ((struct scullv_dev *) filp->private_data)->advice;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -505,6 +517,7 @@ int scullv_trim(struct scullv_dev *dev)
 	dev->qset = scullv_qset;
 	dev->order = scullv_order;
 	dev->next = NULL;
+	dev->cursor = NULL;
 	return 0;
 }
 
@@ -560,6 +573,7 @@ int scullv_init(void)
 		scullv_devices[i].order = scullv_order;
 		scullv_devices[i].qset = scullv_qset;
 		sema_init (&scullv_devices[i].sem, 1);
+		sema_init (&scullv_devices[i].fa_sem, 1);
 		scullv_setup_cdev(scullv_devices + i, i);
 	}
 
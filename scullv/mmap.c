@@ -20,6 +20,7 @@
 
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
+#include <linux/sched.h>	/* current */
 #include <asm/pgtable.h>
 
 #include "scullv.h"		/* local definitions */
@@ -44,42 +45,99 @@ void scullv_vma_close(struct vm_area_struct *vma)
 	dev->vmas--;
 }
 
+/*
+ * Find list item "item" for the fault handler. Sequential faults would
+ * walk the list from its head every time, so the last item found is
+ * remembered; scullv_trim forgets it. The semaphore is held.
+ */
+static struct scullv_dev *scullv_fault_item(struct scullv_dev *dev, int item)
+{
+	struct scullv_dev *ptr = dev;
+	int n = 0;
+
+	if (dev->cursor && dev->cursor_item <= item) {
+		ptr = dev->cursor;
+		n = dev->cursor_item;
+	}
+	for (; ptr && n < item; n++)
+		ptr = ptr->next;
+	if (ptr) {
+		dev->cursor = ptr;
+		dev->cursor_item = item;
+	}
+	return ptr;
+}
+
+/*
+ * Fault-around: after a fault, bring in the next pages of the mapping
+ * as well, so that a sequential scan takes one fault every few pages.
+ * A module has no way to fill in page tables by itself, so the pages
+ * are faulted in with get_user_pages, which calls nopage for each of
+ * them; it stops at the first hole. Those nested calls must not do it
+ * again, hence fa_owner; and if somebody else is at it, we just skip.
+ * mmap_sem is held, as get_user_pages wants.
+ */
+static void scullv_vma_fault_around(struct vm_area_struct *vma,
+		unsigned long address)
+{
+	struct scullv_dev *dev = vma->vm_private_data;
+	unsigned long start = (address & PAGE_MASK) + PAGE_SIZE, end;
+	int npages;
+
+	switch (dev->advice) {
+	case SCULLV_ADV_RANDOM:
+		return;
+	case SCULLV_ADV_SEQUENTIAL:
+		npages = SCULLV_FAULT_SEQ;
+		break;
+	default:
+		npages = scullv_fault_around;
+	}
+	if (npages <= 0 || start >= vma->vm_end)
+		return;
+	end = min(vma->vm_end, start + npages * PAGE_SIZE);
+	if (down_trylock(&dev->fa_sem))
+		return;
+	dev->fa_owner = current;
+	get_user_pages(current, vma->vm_mm, start, (end - start) >> PAGE_SHIFT,
+			0, 0, NULL, NULL);
+	dev->fa_owner = NULL;
+	up(&dev->fa_sem);
+}
+
 /*
  * The nopage method: the core of the file. It retrieves the
  * page required from the scullv device and returns it to the
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * vmalloc memory is made of single pages, each with its own count, so
+ * any page of a quantum can be mapped whatever the "order".
  */
 
 struct page *scullv_vma_nopage(struct vm_area_struct *vma,
                                 unsigned long address, int *type)
 {
-	unsigned long offset;
+	unsigned long pgoff;
 	struct scullv_dev *ptr, *dev = vma->vm_private_data;
 	struct page *page = NOPAGE_SIGBUS;
 	void *pageptr = NULL; /* default to "missing" */
+	int qpages, rest;
 
 	down(&dev->sem);
-	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
+	pgoff = ((address - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	if (pgoff >= (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		goto out; /* out of range */
 
 	/*
 	 * Now retrieve the scullv device from the list,then the page.
 	 * If the device has holes, the process receives a SIGBUS when
 	 * accessing the hole.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
-	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
+	qpages = 1 << dev->order; /* pages in a quantum */
+	ptr = scullv_fault_item(dev, pgoff / (dev->qset * qpages));
+	rest = pgoff % (dev->qset * qpages);
+	if (ptr && ptr->data) pageptr = ptr->data[rest / qpages];
 	if (!pageptr) goto out; /* hole or end-of-file */
 
 	/*
@@ -87,7 +145,7 @@ struct page *scullv_vma_nopage(struct vm_area_struct *vma,
 	 * needed by the current process. Since it's a vmalloc address,
 	 * turn it into a struct page.
 	 */
-	page = vmalloc_to_page(pageptr);
+	page = vmalloc_to_page(pageptr + (rest % qpages) * PAGE_SIZE);
 
 	/* got it, now increment the count */
 	get_page(page);
@@ -95,6 +153,8 @@ struct page *scullv_vma_nopage(struct vm_area_struct *vma,
 		*type = VM_FAULT_MINOR;
   out:
 	up(&dev->sem);
+	if (page != NOPAGE_SIGBUS && dev->fa_owner != current)
+		scullv_vma_fault_around(vma, address);
 	return page;
 }
 
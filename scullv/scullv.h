@@ -56,6 +56,11 @@ struct scullv_dev {
 	void **data;
 	struct scullv_dev *next;  /* next listitem */
 	int vmas;                 /* active mappings */
+	struct scullv_dev *cursor; /* last item found by nopage */
+	int cursor_item;          /* and its number in the list */
+	int advice;               /* access pattern, SCULLV_ADV_* */
+	struct semaphore fa_sem;  /* one fault-around at a time */
+	struct task_struct *fa_owner; /* and who's doing it */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
@@ -74,6 +79,7 @@ extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern int scullv_fault_around;
 
 /*
  * Prototypes for shared functions
@@ -116,7 +122,20 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
 #define SCULLV_IOCXQSET    _IOWR(SCULLV_IOC_MAGIC,11, int)
 #define SCULLV_IOCHQSET    _IO(SCULLV_IOC_MAGIC,  12)
 
-#define SCULLV_IOC_MAXNR 12
+/*
+ * How the device is going to be accessed through mmap, like madvise():
+ * it decides how many pages each fault brings in (see mmap.c).
+ */
+#define SCULLV_ADV_NORMAL     0 /* scullv_fault_around pages */
+#define SCULLV_ADV_RANDOM     1 /* just the one faulted */
+#define SCULLV_ADV_SEQUENTIAL 2 /* SCULLV_FAULT_SEQ pages */
+#define SCULLV_FAULT_AROUND   16
+#define SCULLV_FAULT_SEQ      64
+
+#define SCULLV_IOCTADVICE  _IO(SCULLV_IOC_MAGIC,  13)
+#define SCULLV_IOCQADVICE  _IO(SCULLV_IOC_MAGIC,  14)
+
+#define SCULLV_IOC_MAXNR 14
 
 
 
@@ -31,8 +31,14 @@
 #include <linux/netdevice.h>   /* struct device, and other headers */
 #include <linux/etherdevice.h> /* eth_type_trans */
 #include <linux/ip.h>          /* struct iphdr */
+#include <net/ip.h>            /* IP_MF, IP_OFFSET */
+#include <net/dst.h>           /* dst_release() */
 #include <linux/tcp.h>         /* struct tcphdr */
 #include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/device.h>      /* class_device attributes */
+#include <linux/kthread.h>
+#include <linux/jhash.h>
 
 #include "snull.h"
 
@@ -52,6 +58,32 @@ module_param(lockup, int, 0);
 static int timeout = SNULL_TIMEOUT;
 module_param(timeout, int, 0);
 
+/*
+ * The receive ring: its size is rounded up to a power of two. With
+ * NAPI, a poll takes up to napi_weight packets off it at once.
+ */
+static int rx_ring_size = 64;
+module_param(rx_ring_size, int, 0);
+static int napi_weight = 16;
+module_param(napi_weight, int, 0);
+#define SNULL_RX_BATCH 64	/* the most a poll takes at once */
+
+/*
+ * With zero_copy, the transmitted skb itself is handed to the twin
+ * interface, and the packet pool isn't used.
+ */
+static int zero_copy = 0;
+module_param(zero_copy, int, 0);
+
+/*
+ * With more than one receive queue, flows are spread over the queues
+ * by a hash of their addresses and ports, and each queue is emptied by
+ * a thread bound to its own CPU.
+ */
+static int rx_queues = 1;
+module_param(rx_queues, int, 0);
+#define SNULL_MAX_QUEUES 16
+
 /*
  * Do we run in NAPI mode?
  */
@@ -69,8 +101,61 @@ struct snull_packet {
 	u8 data[ETH_DATA_LEN];
 };
 
+/*
+ * The size of each device's packet pool; it can be changed at run
+ * time, through sysfs.
+ */
+static int snull_set_pool_size(const char *val, struct kernel_param *kp);
 int pool_size = 8;
-module_param(pool_size, int, 0);
+module_param_call(pool_size, snull_set_pool_size, param_get_int, &pool_size,
+		S_IRUGO | S_IWUSR);
+
+/*
+ * The pool is shared by all CPUs, but each one keeps a few packets in
+ * a cache of its own, which it uses with interrupts off but without
+ * taking a lock. Packets move between the cache and the pool in
+ * batches of up to SNULL_BATCH, so the pool lock is only taken once in
+ * a while. The simulated interrupts are synchronous, so a packet is
+ * normally given back on the CPU that took it.
+ */
+#define SNULL_BATCH 16
+
+/*
+ * An entry in the receive ring: a packet from the pool, or, with
+ * zero_copy, the sender's skb.
+ */
+struct snull_rx_desc {
+	struct snull_packet *pkt;
+	struct sk_buff *skb;
+};
+
+/*
+ * A receive queue: a ring whose size is a power of two. The producer is
+ * the twin's snull_hw_tx, the consumer the interrupt handler and
+ * snull_poll (queue 0 only) or the queue's thread. A full ring drops
+ * the packet, like a real NIC out of descriptors.
+ */
+struct snull_rxq {
+	spinlock_t lock;
+	struct snull_rx_desc *ring;
+	unsigned int head, tail;	/* free running, under "lock" */
+	unsigned int mask;		/* ring size - 1 */
+	unsigned int peak;		/* highest occupancy seen */
+	unsigned long polls;		/* batches taken off the ring */
+	unsigned long packets, bytes;	/* the receive stats, per queue */
+	unsigned long dropped, overruns;
+	struct net_device *dev;
+	struct task_struct *task;	/* with rx_queues > 1 */
+	wait_queue_head_t wait;
+	int cpu;
+} ____cacheline_aligned_in_smp;
+
+struct snull_pcache {
+	struct snull_packet *head;
+	int count;
+	unsigned long refills;		/* batches taken from the pool */
+	unsigned long starved;		/* times there was no packet */
+};
 
 /*
  * This structure is private to each device. It is used to pass
@@ -80,8 +165,14 @@ module_param(pool_size, int, 0);
 struct snull_priv {
 	struct net_device_stats stats;
 	int status;
+	spinlock_t pool_lock;		/* protects the next three */
 	struct snull_packet *ppool;
-	struct snull_packet *rx_queue;  /* List of incoming packets */
+	int pool_free;			/* packets in ppool */
+	int pool_total;			/* packets in all, out or not */
+	int batch;			/* how many to move at once */
+	struct snull_pcache *pcache;	/* per-CPU caches */
+	struct snull_rxq *rxq;		/* Incoming packets, in order */
+	int nrxq;
 	int rx_int_enabled;
 	int tx_packetlen;
 	u8 *tx_packetdata;
@@ -90,35 +181,111 @@ struct snull_priv {
 };
 
 static void snull_tx_timeout(struct net_device *dev);
+static int snull_start_queues(struct net_device *dev);
+static void snull_stop_queues(struct net_device *dev);
 static void (*snull_interrupt)(int, void *, struct pt_regs *);
 
 /*
- * Set up a device's packet pool.
+ * A cache holds fewer than 2*batch packets, so the caches together
+ * hold less than half the pool and a starving CPU can always count on
+ * packets coming back to the pool. With a pool too small for that the
+ * batch is 0: packets go through the caches one at a time and none
+ * stay there.
  */
-void snull_setup_pool(struct net_device *dev)
+static int snull_batch_size(void)
+{
+	return min(pool_size/(4*num_possible_cpus()), SNULL_BATCH);
+}
+
+/*
+ * Bring a device's pool to pool_size packets. Only free packets can be
+ * taken away here; if there are too many out, they are freed as they
+ * come back (see snull_pool_spill).
+ */
+static void snull_resize_pool(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	int i;
 	struct snull_packet *pkt;
+	unsigned long flags;
 
-	priv->ppool = NULL;
-	for (i = 0; i < pool_size; i++) {
+	while (priv->pool_total < pool_size) {
 		pkt = kmalloc (sizeof (struct snull_packet), GFP_KERNEL);
 		if (pkt == NULL) {
 			printk (KERN_NOTICE "Ran out of memory allocating packet pool\n");
-			return;
+			break;
 		}
 		pkt->dev = dev;
+		spin_lock_irqsave(&priv->pool_lock, flags);
 		pkt->next = priv->ppool;
 		priv->ppool = pkt;
+		priv->pool_free++;
+		priv->pool_total++;
+		spin_unlock_irqrestore(&priv->pool_lock, flags);
 	}
+	spin_lock_irqsave(&priv->pool_lock, flags);
+	while (priv->pool_total > pool_size && (pkt = priv->ppool)) {
+		priv->ppool = pkt->next;
+		priv->pool_free--;
+		priv->pool_total--;
+		kfree(pkt);
+	}
+	priv->batch = snull_batch_size();
+	spin_unlock_irqrestore(&priv->pool_lock, flags);
+	if (netif_queue_stopped(dev) && priv->pool_free)
+		netif_wake_queue(dev);
+}
+
+static int snull_set_pool_size(const char *val, struct kernel_param *kp)
+{
+	int i, old = pool_size, err = param_set_int(val, kp);
+
+	if (err)
+		return err;
+	if (pool_size < 1) {
+		pool_size = old;
+		return -EINVAL;
+	}
+	for (i = 0; i < 2 && !zero_copy; i++)
+		if (snull_devs[i] && netdev_priv(snull_devs[i]))
+			snull_resize_pool(snull_devs[i]);
+	return 0;
+}
+
+/*
+ * Set up a device's packet pool.
+ */
+void snull_setup_pool(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	spin_lock_init(&priv->pool_lock);
+	priv->ppool = NULL;
+	priv->pcache = alloc_percpu(struct snull_pcache);
+	if (priv->pcache == NULL) {
+		printk (KERN_NOTICE "Ran out of memory allocating packet caches\n");
+		return;
+	}
+	if (!zero_copy)
+		snull_resize_pool(dev);
 }
 
 void snull_teardown_pool(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_pcache *pc;
 	struct snull_packet *pkt;
-    
+	int cpu;
+
+	if (priv->pcache) {
+		for_each_cpu(cpu) {
+			pc = per_cpu_ptr(priv->pcache, cpu);
+			while ((pkt = pc->head)) {
+				pc->head = pkt->next;
+				kfree (pkt);
+			}
+		}
+		free_percpu(priv->pcache);
+	}
 	while ((pkt = priv->ppool)) {
 		priv->ppool = pkt->next;
 		kfree (pkt);
@@ -127,63 +294,305 @@ void snull_teardown_pool(struct net_device *dev)
 }    
 
 /*
- * Buffer/pool management.
+ * Move packets between a CPU's cache and the pool; interrupts are off.
+ * Spilling frees packets instead while the pool is too big.
+ */
+static void snull_pool_refill(struct snull_priv *priv, struct snull_pcache *pc)
+{
+	struct snull_packet *pkt;
+	int n;
+
+	spin_lock(&priv->pool_lock);
+	for (n = 0; n < max(priv->batch, 1) && (pkt = priv->ppool); n++) {
+		priv->ppool = pkt->next;
+		pkt->next = pc->head;
+		pc->head = pkt;
+	}
+	priv->pool_free -= n;
+	spin_unlock(&priv->pool_lock);
+	pc->count += n;
+	pc->refills++;
+}
+
+static void snull_pool_spill(struct snull_priv *priv, struct snull_pcache *pc,
+		int n)
+{
+	struct snull_packet *pkt;
+
+	spin_lock(&priv->pool_lock);
+	while (n-- && (pkt = pc->head)) {
+		pc->head = pkt->next;
+		pc->count--;
+		if (priv->pool_total > pool_size) {
+			priv->pool_total--;
+			kfree(pkt);
+			continue;
+		}
+		pkt->next = priv->ppool;
+		priv->ppool = pkt;
+		priv->pool_free++;
+	}
+	spin_unlock(&priv->pool_lock);
+}
+
+/*
+ * Buffer/pool management. If there's no buffer, the queue is stopped
+ * and NULL returned; the next buffer to come back starts it again.
  */
 struct snull_packet *snull_get_tx_buffer(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	unsigned long flags;
+	struct snull_pcache *pc;
 	struct snull_packet *pkt;
-    
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->ppool;
-	priv->ppool = pkt->next;
-	if (priv->ppool == NULL) {
-		printk (KERN_INFO "Pool empty\n");
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pc = per_cpu_ptr(priv->pcache, smp_processor_id());
+	if (pc->head == NULL)
+		snull_pool_refill(priv, pc);
+	pkt = pc->head;
+	if (pkt) {
+		pc->head = pkt->next;
+		pc->count--;
+	} else {
+		pc->starved++;
 		netif_stop_queue(dev);
 	}
-	spin_unlock_irqrestore(&priv->lock, flags);
+	local_irq_restore(flags);
+	if (pkt == NULL && priv->pool_free)
+		netif_wake_queue(dev); /* one came back meanwhile */
 	return pkt;
 }
 
 
+/*
+ * When the queue is stopped, packets go straight back to the pool,
+ * where a starving CPU can find them.
+ */
 void snull_release_buffer(struct snull_packet *pkt)
 {
+	struct net_device *dev = pkt->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_pcache *pc;
 	unsigned long flags;
+	int stopped = netif_queue_stopped(dev);
+
+	local_irq_save(flags);
+	pc = per_cpu_ptr(priv->pcache, smp_processor_id());
+	pkt->next = pc->head;
+	pc->head = pkt;
+	pc->count++;
+	if (stopped)
+		snull_pool_spill(priv, pc, pc->count);
+	else if (pc->count >= 2*priv->batch || priv->pool_total > pool_size)
+		snull_pool_spill(priv, pc, max(priv->batch, 1));
+	local_irq_restore(flags);
+	if (stopped)
+		netif_wake_queue(dev);
+}
+
+/*
+ * Put a packet straight back in the pool, without waking the queue:
+ * for teardown, when the device is on its way out.
+ */
+static void snull_return_buffer(struct snull_packet *pkt)
+{
 	struct snull_priv *priv = netdev_priv(pkt->dev);
-	
-	spin_lock_irqsave(&priv->lock, flags);
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->pool_lock, flags);
 	pkt->next = priv->ppool;
 	priv->ppool = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	if (netif_queue_stopped(pkt->dev) && pkt->next == NULL)
-		netif_wake_queue(pkt->dev);
+	priv->pool_free++;
+	spin_unlock_irqrestore(&priv->pool_lock, flags);
 }
 
-void snull_enqueue_buf(struct net_device *dev, struct snull_packet *pkt)
+/*
+ * The pool in sysfs: /sys/class/net/snX/pool.
+ */
+static ssize_t snull_show_pool(struct class_device *cd, char *buf)
+{
+	struct net_device *dev = container_of(cd, struct net_device, class_dev);
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_pcache *pc;
+	unsigned long refills = 0, starved = 0;
+	int cpu, cached = 0;
+
+	for_each_cpu(cpu) {
+		pc = per_cpu_ptr(priv->pcache, cpu);
+		cached += pc->count;
+		refills += pc->refills;
+		starved += pc->starved;
+	}
+	return sprintf(buf, "total %i free %i cached %i batch %i "
+			"refills %lu starved %lu\n", priv->pool_total,
+			priv->pool_free, cached, priv->batch, refills, starved);
+}
+static CLASS_DEVICE_ATTR(pool, S_IRUGO, snull_show_pool, NULL);
+
+/*
+ * The receive queues.
+ */
+#define snull_rx_used(q) ((q)->head - (q)->tail)
+
+static int snull_setup_ring(struct net_device *dev)
 {
-	unsigned long flags;
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_rxq *q;
+	unsigned int size = 1;
+	int i;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->rx_queue;  /* FIXME - misorders packets */
-	priv->rx_queue = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	while (size < rx_ring_size && size < 65536)
+		size <<= 1;
+	priv->nrxq = min(max(rx_queues, 1), SNULL_MAX_QUEUES);
+	priv->rxq = kmalloc(priv->nrxq * sizeof(struct snull_rxq), GFP_KERNEL);
+	if (!priv->rxq)
+		return -ENOMEM;
+	memset(priv->rxq, 0, priv->nrxq * sizeof(struct snull_rxq));
+	for (i = 0; i < priv->nrxq; i++) {
+		q = priv->rxq + i;
+		spin_lock_init(&q->lock);
+		init_waitqueue_head(&q->wait);
+		q->dev = dev;
+		q->mask = size - 1;
+		q->ring = kmalloc(size * sizeof(struct snull_rx_desc),
+				GFP_KERNEL);
+		if (!q->ring)
+			return -ENOMEM; /* snull_teardown_ring cleans up */
+	}
+	return 0;
 }
 
-struct snull_packet *snull_dequeue_buf(struct net_device *dev)
+static void snull_teardown_ring(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
+	struct snull_rx_desc *desc;
+	struct snull_rxq *q;
+	int i;
+
+	if (!priv->rxq)
+		return;
+	for (i = 0; i < priv->nrxq; i++) {
+		q = priv->rxq + i;
+		if (!q->ring)
+			continue;
+		/* Give the packets back to the twin's pool */
+		while (snull_rx_used(q)) {
+			desc = q->ring + (q->tail++ & q->mask);
+			if (desc->pkt)
+				snull_return_buffer(desc->pkt);
+			else
+				kfree_skb(desc->skb);
+		}
+		kfree(q->ring);
+	}
+	kfree(priv->rxq);
+	priv->rxq = NULL;
+}
+
+/*
+ * Pick the receive queue for the packet at "buf": a hash of the
+ * addresses, and of the ports for TCP and UDP, so a flow stays in order.
+ */
+static int snull_rx_hash(struct net_device *dev, char *buf, int len)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct iphdr *ih = (struct iphdr *)(buf + sizeof(struct ethhdr));
+	u32 ports = 0;
+
+	if (priv->nrxq == 1)
+		return 0;
+	if ((ih->protocol == IPPROTO_TCP || ih->protocol == IPPROTO_UDP) &&
+			!(ih->frag_off & htons(IP_MF | IP_OFFSET)) &&
+			len >= sizeof(struct ethhdr) + ih->ihl*4 + 4)
+		ports = *(u32 *)((char *) ih + ih->ihl*4);
+	return jhash_3words(ih->saddr, ih->daddr, ports ^ ih->protocol, 0)
+		% priv->nrxq;
+}
+
+/*
+ * Queue a packet or an skb. Returns nonzero, having given the packet
+ * back, if the ring is full.
+ */
+int snull_enqueue_buf(struct net_device *dev, int queue,
+		struct snull_packet *pkt, struct sk_buff *skb)
+{
+	struct snull_rx_desc *desc;
 	unsigned long flags;
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_rxq *q = priv->rxq + queue;
+	unsigned int used;
+
+	spin_lock_irqsave(&q->lock, flags);
+	used = snull_rx_used(q);
+	if (used > q->mask) {
+		q->overruns++;
+		q->dropped++;
+		spin_unlock_irqrestore(&q->lock, flags);
+		if (pkt)
+			snull_release_buffer(pkt);
+		else
+			dev_kfree_skb_any(skb);
+		return -ENOBUFS;
+	}
+	desc = q->ring + (q->head++ & q->mask);
+	desc->pkt = pkt;
+	desc->skb = skb;
+	if (++used > q->peak)
+		q->peak = used;
+	spin_unlock_irqrestore(&q->lock, flags);
+	return 0;
+}
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->rx_queue;
-	if (pkt != NULL)
-		priv->rx_queue = pkt->next;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+/*
+ * Take up to "n" packets, oldest first. The lock is held by the caller.
+ */
+static int __snull_dequeue_bufs(struct snull_rxq *q,
+		struct snull_rx_desc *descs, int n)
+{
+	int i;
+
+	if (n > snull_rx_used(q))
+		n = snull_rx_used(q);
+	for (i = 0; i < n; i++)
+		descs[i] = q->ring[q->tail++ & q->mask];
+	if (n)
+		q->polls++;
+	return n;
+}
+
+int snull_dequeue_bufs(struct snull_rxq *q, struct snull_rx_desc *descs,
+		int n)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	n = __snull_dequeue_bufs(q, descs, n);
+	spin_unlock_irqrestore(&q->lock, flags);
+	return n;
+}
+
+/*
+ * Ring occupancy in sysfs: /sys/class/net/snX/rx_ring, a line per queue.
+ */
+static ssize_t snull_show_ring(struct class_device *cd, char *buf)
+{
+	struct net_device *dev = container_of(cd, struct net_device, class_dev);
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_rxq *q;
+	int i, len = 0;
+
+	for (i = 0; i < priv->nrxq; i++) {
+		q = priv->rxq + i;
+		len += sprintf(buf + len, "%i: cpu %i size %u used %u peak %u "
+				"overruns %lu polls %lu packets %lu\n", i,
+				priv->nrxq > 1 ? q->cpu : -1, q->mask + 1,
+				snull_rx_used(q), q->peak, q->overruns,
+				q->polls, q->packets);
+	}
+	return len;
 }
+static CLASS_DEVICE_ATTR(rx_ring, S_IRUGO, snull_show_ring, NULL);
 
 /*
  * Enable and disable receive interrupts.
@@ -201,6 +610,8 @@ static void snull_rx_ints(struct net_device *dev, int enable)
 
 int snull_open(struct net_device *dev)
 {
+	int err;
+
 	/* request_region(), request_irq(), ....  (like fops->open) */
 
 	/* 
@@ -211,6 +622,10 @@ int snull_open(struct net_device *dev)
 	memcpy(dev->dev_addr, "\0SNUL0", ETH_ALEN);
 	if (dev == snull_devs[1])
 		dev->dev_addr[ETH_ALEN-1]++; /* \0SNUL1 */
+	if ((err = snull_start_queues(dev))) {
+		snull_stop_queues(dev);
+		return err;
+	}
 	netif_start_queue(dev);
 	return 0;
 }
@@ -220,6 +635,7 @@ int snull_release(struct net_device *dev)
     /* release ports, irq and such -- like fops->close */
 
 	netif_stop_queue(dev); /* can't transmit any more */
+	snull_stop_queues(dev);
 	return 0;
 }
 
@@ -248,36 +664,47 @@ int snull_config(struct net_device *dev, struct ifmap *map)
 }
 
 /*
- * Receive a packet: retrieve, encapsulate and pass over to upper levels
+ * Get the skb for a ring entry, ready for the upper levels: with
+ * zero_copy it came with the entry, otherwise it is built around the
+ * packet. NULL if there's no memory.
  */
-void snull_rx(struct net_device *dev, struct snull_packet *pkt)
+static struct sk_buff *snull_rx_skb(struct snull_rxq *q,
+		struct snull_rx_desc *desc)
 {
-	struct sk_buff *skb;
-	struct snull_priv *priv = netdev_priv(dev);
+	struct sk_buff *skb = desc->skb;
+	struct net_device *dev = q->dev;
 
-	/*
-	 * The packet has been retrieved from the transmission
-	 * medium. Build an skb around it, so upper layers can handle it
-	 */
-	skb = dev_alloc_skb(pkt->datalen + 2);
 	if (!skb) {
-		if (printk_ratelimit())
-			printk(KERN_NOTICE "snull rx: low on mem - packet dropped\n");
-		priv->stats.rx_dropped++;
-		goto out;
+		skb = dev_alloc_skb(desc->pkt->datalen + 2);
+		if (!skb) {
+			if (printk_ratelimit())
+				printk(KERN_NOTICE "snull rx: low on mem - packet dropped\n");
+			q->dropped++;
+			return NULL;
+		}
+		skb_reserve(skb, 2); /* align IP on 16B boundary */  
+		memcpy(skb_put(skb, desc->pkt->datalen), desc->pkt->data,
+				desc->pkt->datalen);
 	}
-	skb_reserve(skb, 2); /* align IP on 16B boundary */  
-	memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
 
-	/* Write metadata, and then pass to the receive level */
+	/* Write metadata */
+	q->packets++;
+	q->bytes += skb->len;
 	skb->dev = dev;
 	skb->protocol = eth_type_trans(skb, dev);
 	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-	priv->stats.rx_packets++;
-	priv->stats.rx_bytes += pkt->datalen;
-	netif_rx(skb);
-  out:
-	return;
+	return skb;
+}
+
+/*
+ * Receive a packet: retrieve, encapsulate and pass over to upper levels
+ */
+void snull_rx(struct snull_rxq *q, struct snull_rx_desc *desc)
+{
+	struct sk_buff *skb = snull_rx_skb(q, desc);
+
+	if (skb)
+		netif_rx(skb);
 }
     
 
@@ -286,55 +713,136 @@ void snull_rx(struct net_device *dev, struct snull_packet *pkt)
  */
 static int snull_poll(struct net_device *dev, int *budget)
 {
-	int npackets = 0, quota = min(dev->quota, *budget);
+	int i, n, npackets = 0, quota = min(dev->quota, *budget);
 	struct sk_buff *skb;
 	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
-    
-	while (npackets < quota && priv->rx_queue) {
-		pkt = snull_dequeue_buf(dev);
-		skb = dev_alloc_skb(pkt->datalen + 2);
-		if (! skb) {
-			if (printk_ratelimit())
-				printk(KERN_NOTICE "snull: packet dropped\n");
-			priv->stats.rx_dropped++;
-			snull_release_buffer(pkt);
-			continue;
+	struct snull_rx_desc descs[SNULL_RX_BATCH];
+	unsigned long flags;
+
+	/* Take a whole batch off the ring in one go */
+	n = snull_dequeue_bufs(priv->rxq, descs, min(quota, SNULL_RX_BATCH));
+	for (i = 0; i < n; i++) {
+		skb = snull_rx_skb(priv->rxq, descs + i);
+		if (skb) {
+			netif_receive_skb(skb);
+			npackets++;
 		}
-		skb_reserve(skb, 2); /* align IP on 16B boundary */  
-		memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
-		skb->dev = dev;
-		skb->protocol = eth_type_trans(skb, dev);
-		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-		netif_receive_skb(skb);
-		
-        	/* Maintain stats */
-		npackets++;
-		priv->stats.rx_packets++;
-		priv->stats.rx_bytes += pkt->datalen;
-		snull_release_buffer(pkt);
+		if (descs[i].pkt)
+			snull_release_buffer(descs[i].pkt);
 	}
 	/* If we processed all packets, we're done; tell the kernel and reenable ints */
 	*budget -= npackets;
 	dev->quota -= npackets;
-	if (! priv->rx_queue) {
+	spin_lock_irqsave(&priv->rxq->lock, flags);
+	if (! snull_rx_used(priv->rxq)) {
 		netif_rx_complete(dev);
 		snull_rx_ints(dev, 1);
+		spin_unlock_irqrestore(&priv->rxq->lock, flags);
 		return 0;
 	}
+	spin_unlock_irqrestore(&priv->rxq->lock, flags);
 	/* We couldn't process everything. */
 	return 1;
 }
 	    
         
+/*
+ * With several receive queues, each is emptied by a thread of its own
+ * instead of the interrupt handler or snull_poll, which only know of
+ * one queue per device. It takes batches like snull_poll does.
+ */
+static int snull_rxq_thread(void *data)
+{
+	struct snull_rxq *q = data;
+	struct snull_rx_desc descs[SNULL_RX_BATCH];
+	struct sk_buff *skb;
+	int i, n;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(q->wait, snull_rx_used(q) ||
+				kthread_should_stop());
+		n = snull_dequeue_bufs(q, descs, min(napi_weight, SNULL_RX_BATCH));
+		local_bh_disable(); /* netif_receive_skb runs in softirqs */
+		for (i = 0; i < n; i++) {
+			skb = snull_rx_skb(q, descs + i);
+			if (skb)
+				netif_receive_skb(skb);
+			if (descs[i].pkt)
+				snull_release_buffer(descs[i].pkt);
+		}
+		local_bh_enable();
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * Start a thread per queue, on a CPU each, going round the online ones.
+ */
+static int snull_start_queues(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_rxq *q;
+	int i, cpu = -1;
+
+	if (priv->nrxq == 1)
+		return 0;
+	for (i = 0; i < priv->nrxq; i++) {
+		q = priv->rxq + i;
+		do {
+			cpu = next_cpu(cpu, cpu_online_map);
+			if (cpu >= NR_CPUS)
+				cpu = -1;
+		} while (cpu < 0);
+		q->cpu = cpu;
+		q->task = kthread_create(snull_rxq_thread, q, "%s/%i",
+				dev->name, i);
+		if (IS_ERR(q->task)) {
+			int err = PTR_ERR(q->task);
+			q->task = NULL;
+			return err;
+		}
+		kthread_bind(q->task, cpu);
+		wake_up_process(q->task);
+	}
+	return 0;
+}
+
+static void snull_stop_queues(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
+	for (i = 0; i < priv->nrxq; i++)
+		if (priv->rxq[i].task) {
+			kthread_stop(priv->rxq[i].task);
+			priv->rxq[i].task = NULL;
+		}
+}
+
+/*
+ * A packet is in queue "queue": raise the interrupt, or wake the thread.
+ */
+static void snull_rx_kick(struct net_device *dev, int queue)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (priv->nrxq > 1)
+		wake_up(&priv->rxq[queue].wait);
+	else if (priv->rx_int_enabled) {
+		priv->status |= SNULL_RX_INTR;
+		snull_interrupt(0, dev, NULL);
+	}
+}
+
 /*
  * The typical interrupt entry point
  */
 static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
-	int statusword;
+	int statusword, n;
 	struct snull_priv *priv;
-	struct snull_packet *pkt = NULL;
+	struct snull_rx_desc desc = { NULL, NULL };
 	/*
 	 * As usual, check the "device" pointer to be sure it is
 	 * really interrupting.
@@ -356,11 +864,11 @@ static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	priv->status = 0;
 	if (statusword & SNULL_RX_INTR) {
 		/* send it to snull_rx for handling */
-		pkt = priv->rx_queue;
-		if (pkt) {
-			priv->rx_queue = pkt->next;
-			snull_rx(dev, pkt);
-		}
+		spin_lock(&priv->rxq->lock);
+		n = __snull_dequeue_bufs(priv->rxq, &desc, 1);
+		spin_unlock(&priv->rxq->lock);
+		if (n)
+			snull_rx(priv->rxq, &desc);
 	}
 	if (statusword & SNULL_TX_INTR) {
 		/* a transmission is over: free the skb */
@@ -371,7 +879,7 @@ static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 
 	/* Unlock the device and we are done */
 	spin_unlock(&priv->lock);
-	if (pkt) snull_release_buffer(pkt); /* Do this outside the lock! */
+	if (desc.pkt) snull_release_buffer(desc.pkt); /* Do this outside the lock! */
 	return;
 }
 
@@ -419,10 +927,30 @@ static void snull_napi_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 
 
 
+/*
+ * Swap the networks in the IP header at "buf", past the ethernet one.
+ */
+static struct iphdr *snull_rewrite_ip(char *buf)
+{
+	/*
+	 * Ethhdr is 14 bytes, but the kernel arranges for iphdr
+	 * to be aligned (i.e., ethhdr is unaligned)
+	 */
+	struct iphdr *ih = (struct iphdr *)(buf+sizeof(struct ethhdr));
+	u32 *saddr = &ih->saddr, *daddr = &ih->daddr;
+
+	((u8 *)saddr)[2] ^= 1; /* change the third octet (class C) */
+	((u8 *)daddr)[2] ^= 1;
+
+	ih->check = 0;         /* and rebuild the checksum (ip needs it) */
+	ih->check = ip_fast_csum((unsigned char *)ih,ih->ihl);
+	return ih;
+}
+
 /*
  * Transmit a packet (low level interface)
  */
-static void snull_hw_tx(char *buf, int len, struct net_device *dev)
+static int snull_hw_tx(char *buf, int len, struct net_device *dev)
 {
 	/*
 	 * This function deals with hw details. This interface loops
@@ -433,16 +961,21 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	struct iphdr *ih;
 	struct net_device *dest;
 	struct snull_priv *priv;
-	u32 *saddr, *daddr;
 	struct snull_packet *tx_buffer;
+	int queue;
     
 	/* I am paranoid. Ain't I? */
 	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
 		printk("snull: Hmm... packet too short (%i octets)\n",
 				len);
-		return;
+		return 0;
 	}
 
+	/* Get a buffer before touching the packet, which may come back */
+	tx_buffer = snull_get_tx_buffer(dev);
+	if (tx_buffer == NULL)
+		return -EBUSY;
+
 	if (0) { /* enable this conditional to look at the data */
 		int i;
 		PDEBUG("len is %i\n" KERN_DEBUG "data:",len);
@@ -450,19 +983,7 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 			printk(" %02x",buf[i]&0xff);
 		printk("\n");
 	}
-	/*
-	 * Ethhdr is 14 bytes, but the kernel arranges for iphdr
-	 * to be aligned (i.e., ethhdr is unaligned)
-	 */
-	ih = (struct iphdr *)(buf+sizeof(struct ethhdr));
-	saddr = &ih->saddr;
-	daddr = &ih->daddr;
-
-	((u8 *)saddr)[2] ^= 1; /* change the third octet (class C) */
-	((u8 *)daddr)[2] ^= 1;
-
-	ih->check = 0;         /* and rebuild the checksum (ip needs it) */
-	ih->check = ip_fast_csum((unsigned char *)ih,ih->ihl);
+	ih = snull_rewrite_ip(buf);
 
 	if (dev == snull_devs[0])
 		PDEBUGG("%08x:%05i --> %08x:%05i\n",
@@ -479,15 +1000,11 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	 * transmission-done on the transmitting device
 	 */
 	dest = snull_devs[dev == snull_devs[0] ? 1 : 0];
-	priv = netdev_priv(dest);
-	tx_buffer = snull_get_tx_buffer(dev);
 	tx_buffer->datalen = len;
 	memcpy(tx_buffer->data, buf, len);
-	snull_enqueue_buf(dest, tx_buffer);
-	if (priv->rx_int_enabled) {
-		priv->status |= SNULL_RX_INTR;
-		snull_interrupt(0, dest, NULL);
-	}
+	queue = snull_rx_hash(dest, buf, len);
+	if (snull_enqueue_buf(dest, queue, tx_buffer, NULL) == 0)
+		snull_rx_kick(dest, queue);
 
 	priv = netdev_priv(dev);
 	priv->tx_packetlen = len;
@@ -501,6 +1018,51 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	}
 	else
 		snull_interrupt(0, dev, NULL);
+	return 0;
+}
+
+/*
+ * Transmit without copying: the skb itself goes to the twin, like
+ * the loopback driver does. There's no transmit interrupt to wait for.
+ */
+static int snull_tx_skb(struct sk_buff *skb, struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *dest = snull_devs[dev == snull_devs[0] ? 1 : 0];
+	int queue, len = skb->len;
+
+	dev->trans_start = jiffies; /* save the timestamp */
+	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
+		printk("snull: Hmm... packet too short (%i octets)\n",
+				len);
+		goto drop;
+	}
+	/* The headers get rewritten, so they must be ours alone */
+	skb = skb_share_check(skb, GFP_ATOMIC);
+	if (!skb) {
+		priv->stats.tx_dropped++;
+		return 0;
+	}
+	if (skb_cow(skb, 0))
+		goto drop;
+	skb_orphan(skb);
+	/* Arriving on the twin, it must be routed afresh, as input */
+	dst_release(skb->dst);
+	skb->dst = NULL;
+	nf_reset(skb);
+	snull_rewrite_ip((char *) skb->data);
+
+	priv->stats.tx_packets++;
+	priv->stats.tx_bytes += len;
+	queue = snull_rx_hash(dest, (char *) skb->data, len);
+	if (snull_enqueue_buf(dest, queue, NULL, skb) == 0)
+		snull_rx_kick(dest, queue);
+	return 0;
+
+  drop:
+	priv->stats.tx_dropped++;
+	dev_kfree_skb(skb);
+	return 0;
 }
 
 /*
@@ -511,7 +1073,11 @@ int snull_tx(struct sk_buff *skb, struct net_device *dev)
 	int len;
 	char *data, shortpkt[ETH_ZLEN];
 	struct snull_priv *priv = netdev_priv(dev);
+	struct sk_buff *old;
 	
+	if (zero_copy)
+		return snull_tx_skb(skb, dev);
+
 	data = skb->data;
 	len = skb->len;
 	if (len < ETH_ZLEN) {
@@ -523,12 +1089,15 @@ int snull_tx(struct sk_buff *skb, struct net_device *dev)
 	dev->trans_start = jiffies; /* save the timestamp */
 
 	/* Remember the skb, so we can free it at interrupt time */
+	old = priv->skb;
 	priv->skb = skb;
 
 	/* actual deliver of data is device-specific, and not shown here */
-	snull_hw_tx(data, len, dev);
-
-	return 0; /* Our simple device can not fail */
+	if (snull_hw_tx(data, len, dev)) {
+		priv->skb = old;
+		return NETDEV_TX_BUSY; /* out of buffers: queue stopped */
+	}
+	return 0;
 }
 
 /*
@@ -565,6 +1134,19 @@ int snull_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 struct net_device_stats *snull_stats(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_rxq *q;
+	int i;
+
+	/* The receive side is counted per queue */
+	priv->stats.rx_packets = priv->stats.rx_bytes = 0;
+	priv->stats.rx_dropped = priv->stats.rx_fifo_errors = 0;
+	for (i = 0; i < priv->nrxq; i++) {
+		q = priv->rxq + i;
+		priv->stats.rx_packets += q->packets;
+		priv->stats.rx_bytes += q->bytes;
+		priv->stats.rx_dropped += q->dropped;
+		priv->stats.rx_fifo_errors += q->overruns;
+	}
 	return &priv->stats;
 }
 
@@ -657,7 +1239,7 @@ void snull_init(struct net_device *dev)
 	dev->watchdog_timeo = timeout;
 	if (use_napi) {
 		dev->poll        = snull_poll;
-		dev->weight      = 2;
+		dev->weight      = napi_weight;
 	}
 	/* keep the default flags, just add NOARP */
 	dev->flags           |= IFF_NOARP;
@@ -673,6 +1255,8 @@ void snull_init(struct net_device *dev)
 	spin_lock_init(&priv->lock);
 	snull_rx_ints(dev, 1);		/* enable receive interrupts */
 	snull_setup_pool(dev);
+	if (snull_setup_ring(dev))
+		snull_teardown_ring(dev);
 }
 
 /*
@@ -693,7 +1277,19 @@ void snull_cleanup(void)
     
 	for (i = 0; i < 2;  i++) {
 		if (snull_devs[i]) {
+			class_device_remove_file(&snull_devs[i]->class_dev,
+					&class_device_attr_pool);
+			class_device_remove_file(&snull_devs[i]->class_dev,
+					&class_device_attr_rx_ring);
 			unregister_netdev(snull_devs[i]);
+		}
+	}
+	/* Queued packets belong to the twin's pool: empty both rings first */
+	for (i = 0; i < 2;  i++)
+		if (snull_devs[i])
+			snull_teardown_ring(snull_devs[i]);
+	for (i = 0; i < 2;  i++) {
+		if (snull_devs[i]) {
 			snull_teardown_pool(snull_devs[i]);
 			free_netdev(snull_devs[i]);
 		}
@@ -717,14 +1313,24 @@ int snull_init_module(void)
 			snull_init);
 	if (snull_devs[0] == NULL || snull_devs[1] == NULL)
 		goto out;
+	for (i = 0; i < 2;  i++) {
+		struct snull_priv *priv = netdev_priv(snull_devs[i]);
+		if (priv->pcache == NULL || priv->rxq == NULL)
+			goto out;
+	}
 
 	ret = -ENODEV;
 	for (i = 0; i < 2;  i++)
 		if ((result = register_netdev(snull_devs[i])))
 			printk("snull: error %i registering device \"%s\"\n",
 					result, snull_devs[i]->name);
-		else
+		else {
+			class_device_create_file(&snull_devs[i]->class_dev,
+					&class_device_attr_pool);
+			class_device_create_file(&snull_devs[i]->class_dev,
+					&class_device_attr_rx_ring);
 			ret = 0;
+		}
    out:
 	if (ret) 
 		snull_cleanup();